@@ -0,0 +1,9 @@
+#pragma once
+
+#include <cstddef>
+
+
+// Heap allocations made by the calling thread so far. Counted by the
+// operator new replacement in alloc_count.cpp; the counter is thread local,
+// so counting adds no contention to multithreaded benchmarks.
+size_t thread_allocations();
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+
+// One background thread for cache maintenance: runs posted tasks in order
+// and calls `on_period` every `period`.
+// The thread is started by start(), so the worker can be passed around
+// before everything `on_period` uses is constructed.
+// Stopping (explicit or in destructor) waits for the current task,
+// tasks not started yet are dropped.
+class BackgroundWorker {
+
+public:
+    using Task = std::function<void()>;
+
+    BackgroundWorker(std::chrono::milliseconds period, Task on_period) :
+        m_period(period),
+        m_on_period(std::move(on_period))
+    {}
+
+    ~BackgroundWorker() {
+        stop();
+    }
+
+    BackgroundWorker(const BackgroundWorker&) = delete;
+    BackgroundWorker(BackgroundWorker&&) = delete;
+    BackgroundWorker& operator=(BackgroundWorker&) = delete;
+    BackgroundWorker& operator=(BackgroundWorker&&) = delete;
+
+    void start() {
+        std::lock_guard guard(m_mtx);
+        if (!m_thread.joinable() && !m_stopped) {
+            m_thread = std::thread(&BackgroundWorker::run, this);
+        }
+    }
+
+    // tasks posted before start() wait for it
+    void post(Task task) {
+        {
+            std::lock_guard guard(m_mtx);
+            if (m_stopped) {
+                return;
+            }
+            m_tasks.push_back(std::move(task));
+        }
+        m_cv.notify_one();
+    }
+
+    void stop() {
+        {
+            std::lock_guard guard(m_mtx);
+            m_stopped = true;
+            m_tasks.clear();
+        }
+        m_cv.notify_one();
+
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+    }
+
+private:
+    const std::chrono::milliseconds m_period;
+    const Task m_on_period;
+
+    std::deque<Task> m_tasks;
+    bool m_stopped = false;
+
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+
+    std::thread m_thread;
+
+    void run() {
+        auto next_period = std::chrono::steady_clock::now() + m_period;
+
+        std::unique_lock guard(m_mtx);
+        while (!m_stopped) {
+            if (m_tasks.empty()) {
+                m_cv.wait_until(guard, next_period, [this]() { return m_stopped || !m_tasks.empty(); });
+            }
+            if (m_stopped) {
+                break;
+            }
+
+            if (!m_tasks.empty()) {
+                auto task = std::move(m_tasks.front());
+                m_tasks.pop_front();
+
+                guard.unlock();
+                task();
+                guard.lock();
+            }
+
+            if (std::chrono::steady_clock::now() >= next_period) {
+                guard.unlock();
+                m_on_period();
+                guard.lock();
+                next_period = std::chrono::steady_clock::now() + m_period;
+            }
+        }
+    }
+};
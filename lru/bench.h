@@ -0,0 +1,318 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+
+namespace bench {
+
+// Request pool built once, so key construction is not measured.
+inline std::vector<std::string> make_keys(size_t count) {
+    std::vector<std::string> keys;
+    keys.reserve(count);
+    for (size_t i = 1; i <= count; ++i) {
+        keys.emplace_back("req_" + std::to_string(i));
+    }
+    return keys;
+}
+
+// Zipf distribution over [0, n): index k is drawn with probability
+// proportional to 1 / (k + 1)^s. Copies share the precomputed CDF.
+class ZipfDistribution {
+public:
+    ZipfDistribution(size_t n, double s) : m_cdf(std::make_shared<std::vector<double>>(n)) {
+        double sum = 0;
+        for (size_t k = 0; k < n; ++k) {
+            sum += 1.0 / std::pow(k + 1, s);
+            (*m_cdf)[k] = sum;
+        }
+        for (auto& v : *m_cdf) {
+            v /= sum;
+        }
+    }
+
+    template<typename Gen>
+    size_t operator()(Gen& gen) {
+        double u = m_uniform(gen);
+        auto it = std::lower_bound(m_cdf->begin(), m_cdf->end(), u);
+        return std::min<size_t>(it - m_cdf->begin(), m_cdf->size() - 1);
+    }
+
+private:
+    std::shared_ptr<std::vector<double>> m_cdf;
+    std::uniform_real_distribution<double> m_uniform{0.0, 1.0};
+};
+
+// Zipf requests over [0, hot) mixed with a sequential scan over
+// [hot, hot + scan): each index is a scan step with probability `scan_share`.
+// Every copy starts its scan from a random position.
+class ScanMixDistribution {
+public:
+    ScanMixDistribution(size_t hot, double s, size_t scan, double scan_share) :
+        m_hot(hot), m_scan(scan), m_zipf(hot, s), m_scan_share(scan_share)
+    {}
+
+    template<typename Gen>
+    size_t operator()(Gen& gen) {
+        if (m_uniform(gen) >= m_scan_share) {
+            return m_zipf(gen);
+        }
+        if (m_pos == SIZE_MAX) {
+            m_pos = std::uniform_int_distribution<size_t>(0, m_scan - 1)(gen);
+        }
+        m_pos = (m_pos + 1) % m_scan;
+        return m_hot + m_pos;
+    }
+
+private:
+    size_t m_hot;
+    size_t m_scan;
+    ZipfDistribution m_zipf;
+    double m_scan_share;
+    size_t m_pos = SIZE_MAX;
+    std::uniform_real_distribution<double> m_uniform{0.0, 1.0};
+};
+
+inline std::uniform_int_distribution<size_t> uniform(size_t n) {
+    return std::uniform_int_distribution<size_t>(0, n - 1);
+}
+
+struct Result {
+    double ops_per_sec = 0;
+    // latency of a single request
+    std::chrono::nanoseconds p50{0};
+    std::chrono::nanoseconds p99{0};
+    std::chrono::nanoseconds p999{0};
+};
+
+// Runs `threads` workers, each making `ops` steps. A step (made by
+// `make_step` per worker) gets the worker's random generator and prepares
+// the requests, then the callable it returns is timed.
+// `items` - requests made by one step.
+template<typename MakeStep>
+Result run_steps(const MakeStep& make_step, unsigned threads, size_t ops, size_t items) {
+    using Clock = std::chrono::steady_clock;
+
+    std::vector<std::vector<uint32_t>> latencies(threads);
+    std::vector<std::thread> workers;
+
+    auto start = Clock::now();
+    for (unsigned i = 0; i < threads; ++i) {
+        workers.emplace_back([step = make_step(), ops, seed = i, &latencies = latencies[i]]() mutable {
+            std::mt19937 gen(seed);
+            latencies.reserve(ops);
+            for (size_t j = 0; j < ops; ++j) {
+                auto requests = step(gen);
+                auto begin = Clock::now();
+                requests();
+                auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - begin).count();
+                latencies.push_back(static_cast<uint32_t>(std::min<int64_t>(ns, UINT32_MAX)));
+            }
+        });
+    }
+    for (auto& t : workers) {
+        t.join();
+    }
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+
+    std::vector<uint32_t> all;
+    all.reserve(threads * ops);
+    for (auto& l : latencies) {
+        all.insert(all.end(), l.begin(), l.end());
+    }
+
+    Result ret;
+    ret.ops_per_sec = threads * ops * items / elapsed.count();
+    if (!all.empty()) {
+        auto percentile = [&all](double q) {
+            auto it = all.begin() + static_cast<size_t>(q * (all.size() - 1));
+            std::nth_element(all.begin(), it, all.end());
+            return std::chrono::nanoseconds(*it);
+        };
+        ret.p50 = percentile(0.5);
+        ret.p99 = percentile(0.99);
+        ret.p999 = percentile(0.999);
+    }
+    return ret;
+}
+
+// Runs `threads` workers, each making `ops` calls of `request` with keys
+// from `keys` picked by (a copy of) `dist`, every call is timed.
+template<typename Request, typename Dist>
+Result run(const Request& request, const std::vector<std::string>& keys, const Dist& dist, unsigned threads, size_t ops) {
+    auto make_step = [&request, &keys, &dist]() {
+        return [&request, &keys, dist = dist](std::mt19937& gen) mutable {
+            auto& req = keys[dist(gen)];
+            return [&request, &req]() { request(req); };
+        };
+    };
+    return run_steps(make_step, threads, ops, 1);
+}
+
+// Same as run(), but every call of `request` gets `batch` keys
+// (std::vector<std::string_view>). Throughput counts keys, latency is
+// of the whole batch, `ops` - keys per worker.
+template<typename Request, typename Dist>
+Result run_batches(const Request& request, const std::vector<std::string>& keys, const Dist& dist, unsigned threads, size_t ops, size_t batch) {
+    auto make_step = [&request, &keys, &dist, batch]() {
+        return [&request, &keys, dist = dist, batch, reqs = std::vector<std::string_view>()](std::mt19937& gen) mutable {
+            reqs.clear();
+            while (reqs.size() < batch) {
+                reqs.push_back(keys[dist(gen)]);
+            }
+            return [&request, &reqs]() { request(reqs); };
+        };
+    };
+    return run_steps(make_step, threads, std::max<size_t>(1, ops / batch), batch);
+}
+
+inline void print_header() {
+    std::printf("%-28s %12s %8s %10s %10s %10s\n", "", "req/s", "hit", "p50 ns", "p99 ns", "p99.9 ns");
+}
+
+inline void print_result(const char* name, const Result& result) {
+    std::printf("%-28s %12.0f %8s %10lld %10lld %10lld\n", name, result.ops_per_sec, "",
+                static_cast<long long>(result.p50.count()), static_cast<long long>(result.p99.count()), static_cast<long long>(result.p999.count()));
+}
+
+inline void print_result(const char* name, const Result& result, double hit_ratio) {
+    std::printf("%-28s %12.0f %7.2f%% %10lld %10lld %10lld\n", name, result.ops_per_sec, hit_ratio * 100,
+                static_cast<long long>(result.p50.count()), static_cast<long long>(result.p99.count()), static_cast<long long>(result.p999.count()));
+}
+
+
+// Command line of the benchmark:
+//   --threads 1,4,16     worker counts, every workload runs with each
+//   --ops N              requests per worker
+//   --cache N            cache capacity in entries
+//   --uniform-keys N     distinct keys of the uniform workload
+//   --keys N             distinct keys of zipf and scan workloads (each)
+//   --dist uniform,zipf,scan
+//   --zipf S             skew of zipf and scan workloads
+//   --scan-share F       share of scan requests in the scan workload
+//   --reply-size B       bytes of a generated reply
+//   --gen-latency US     time prepare_reply takes, microseconds
+//   --cache-type NAME    run only cache variants whose name contains NAME
+struct Options {
+    std::vector<unsigned> threads;
+    size_t ops = 200000;
+    size_t cache_size = 1000;
+    size_t uniform_keys = 1200;
+    size_t keys = 100000;
+    std::vector<std::string> dists{"uniform", "zipf", "scan"};
+    double zipf_s = 0.99;
+    double scan_share = 0.3;
+    size_t reply_size = 4096;
+    std::chrono::microseconds gen_latency{0};
+    std::string cache_type;
+
+    bool runs(const std::string& dist) const {
+        return std::find(dists.begin(), dists.end(), dist) != dists.end();
+    }
+
+    bool runs_cache(const char* name) const {
+        return cache_type.empty() || std::string(name).find(cache_type) != std::string::npos;
+    }
+};
+
+inline std::vector<std::string> split(const std::string& list) {
+    std::vector<std::string> ret;
+    size_t begin = 0;
+    while (begin <= list.size()) {
+        size_t end = std::min(list.find(',', begin), list.size());
+        if (end > begin) {
+            ret.push_back(list.substr(begin, end - begin));
+        }
+        begin = end + 1;
+    }
+    return ret;
+}
+
+inline void print_usage(const char* program) {
+    std::fprintf(stderr,
+                 "usage: %s [--threads 1,4,16] [--ops N] [--cache N] [--uniform-keys N] [--keys N]\n"
+                 "       [--dist uniform,zipf,scan] [--zipf S] [--scan-share F] [--reply-size B] [--gen-latency US] [--cache-type NAME]\n",
+                 program);
+}
+
+// false on unknown option or bad value, usage is printed then
+inline bool parse_options(int argc, const char** argv, Options& options) {
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string name = argv[i];
+            if (i + 1 == argc) {
+                print_usage(argv[0]);
+                return false;
+            }
+            std::string value = argv[++i];
+
+            if (name == "--threads") {
+                options.threads.clear();
+                for (auto& t : split(value)) {
+                    options.threads.push_back(static_cast<unsigned>(std::stoul(t)));
+                }
+            }
+            else if (name == "--ops") {
+                options.ops = std::stoull(value);
+            }
+            else if (name == "--cache") {
+                options.cache_size = std::stoull(value);
+            }
+            else if (name == "--uniform-keys") {
+                options.uniform_keys = std::stoull(value);
+            }
+            else if (name == "--keys") {
+                options.keys = std::stoull(value);
+            }
+            else if (name == "--dist") {
+                options.dists = split(value);
+            }
+            else if (name == "--zipf") {
+                options.zipf_s = std::stod(value);
+            }
+            else if (name == "--scan-share") {
+                options.scan_share = std::stod(value);
+            }
+            else if (name == "--reply-size") {
+                options.reply_size = std::stoull(value);
+            }
+            else if (name == "--gen-latency") {
+                options.gen_latency = std::chrono::microseconds(std::stoll(value));
+            }
+            else if (name == "--cache-type") {
+                options.cache_type = value;
+            }
+            else {
+                print_usage(argv[0]);
+                return false;
+            }
+        }
+    }
+    catch (const std::exception&) {
+        print_usage(argv[0]);
+        return false;
+    }
+
+    for (auto& dist : options.dists) {
+        if (dist != "uniform" && dist != "zipf" && dist != "scan") {
+            print_usage(argv[0]);
+            return false;
+        }
+    }
+    if (options.threads.empty()) {
+        options.threads.push_back(std::max(4u, std::thread::hardware_concurrency()));
+    }
+    return options.uniform_keys > 0 && options.keys > 0 && options.ops > 0;
+}
+
+} // namespace bench
@@ -0,0 +1,163 @@
+#pragma once
+
+#include "lru.h"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+
+// Approximate LRU (CLOCK / second chance) with the same contract as LruCache.
+// Requests live in a hash table split into segments with reader-writer locks.
+// A hit takes the shared lock of its segment (an atomic write to the lock
+// word, no waiting for other readers) and sets the reference bit of the
+// entry unless it is set already; no list is relinked as in LruCache.
+// Misses are not coalesced: concurrent misses on one request all generate
+// the reply, so its hit ratio and latency are not directly comparable to LruCache.
+// Insertion and eviction are serialized by a separate lock: the clock hand
+// goes over the ring of entries, clears set reference bits and evicts the
+// first entry that was not referenced since the previous pass.
+template<typename TReq, typename TRep, typename Hash = std::hash<TReq>>
+class ClockCache {
+
+public:
+    using ReplyPtr = typename LruCacheCore<TReq, TRep>::ReplyPtr;
+
+    static constexpr size_t DEFAULT_SEGMENTS = 64;
+
+    ClockCache(size_t size, size_t segments = DEFAULT_SEGMENTS) :
+        m_max_size(std::max<size_t>(1, size)),
+        m_segments(std::max<size_t>(1, segments))
+    {
+        m_ring.reserve(m_max_size);
+    }
+
+    virtual ~ClockCache() = default;
+    ClockCache(const ClockCache&) = delete;
+    ClockCache(ClockCache&&) = delete;
+    ClockCache& operator=(ClockCache&) = delete;
+    ClockCache& operator=(ClockCache&&) = delete;
+
+    TRep make_request(const TReq& req) {
+        return *make_shared_request(req);
+    }
+
+    ReplyPtr make_shared_request(const TReq& req) {
+        size_t segment = m_hash(req) % m_segments.size();
+
+        if (auto reply = find(req, segment)) {
+            return reply;
+        }
+
+        return add_new_item_in_cache(req, segment, std::make_shared<const TRep>(prepare_reply(req)));
+    }
+
+protected:
+    virtual TRep prepare_reply(const TReq& req) const;
+
+private:
+    struct Entry {
+        Entry(ReplyPtr reply_) : reply(std::move(reply_)) {}
+
+        const ReplyPtr reply;
+        std::atomic<bool> referenced = false;
+    };
+
+    struct alignas(64) Segment {
+        std::unordered_map<TReq, Entry, Hash> entries;
+        mutable std::shared_mutex mtx;
+    };
+
+    struct RingItem {
+        const TReq* req;
+        Entry* entry;
+        size_t segment;
+    };
+
+    const size_t m_max_size = 0;
+
+    std::vector<Segment> m_segments;
+    Hash m_hash;
+
+    // entries in insertion order, the clock hand walks over it
+    // guarded by m_evict_mtx
+    std::vector<RingItem> m_ring;
+    size_t m_hand = 0;
+
+    std::mutex m_evict_mtx;
+
+    ReplyPtr find(const TReq& req, size_t segment) {
+        auto& seg = m_segments[segment];
+        std::shared_lock guard(seg.mtx);
+
+        auto it = seg.entries.find(req);
+        if (it == seg.entries.end()) {
+            return {};
+        }
+
+        // avoid dirtying the cache line if the bit is already set
+        auto& referenced = it->second.referenced;
+        if (!referenced.load(std::memory_order_relaxed)) {
+            referenced.store(true, std::memory_order_relaxed);
+        }
+
+        INFO(req, "found");
+        return it->second.reply;
+    }
+
+    ReplyPtr add_new_item_in_cache(const TReq& req, size_t segment, ReplyPtr reply) {
+        std::lock_guard evict_guard(m_evict_mtx);
+
+        // entries are added and removed only under m_evict_mtx,
+        // so the result of this check holds until the insertion
+        if (auto existing = find(req, segment)) {
+            // inserted in another thread
+            return existing;
+        }
+
+        size_t pos = m_ring.size();
+        if (pos == m_max_size) {
+            pos = evict();
+        }
+        else {
+            m_ring.emplace_back();
+        }
+
+        auto& seg = m_segments[segment];
+        std::unique_lock guard(seg.mtx);
+
+        auto it = seg.entries.emplace(std::piecewise_construct, std::forward_as_tuple(req), std::forward_as_tuple(reply)).first;
+        m_ring[pos] = RingItem{&it->first, &it->second, segment};
+
+        INFO(req, "added");
+        return reply;
+    }
+
+    size_t evict() {
+        // guard outside
+
+        // second pass over the ring always finds an entry with cleared bit
+        while (true) {
+            auto& item = m_ring[m_hand];
+            size_t pos = m_hand;
+            m_hand = (m_hand + 1) % m_ring.size();
+
+            if (item.entry->referenced.exchange(false, std::memory_order_relaxed)) {
+                continue;
+            }
+
+            auto& seg = m_segments[item.segment];
+            std::unique_lock guard(seg.mtx);
+
+            INFO(*item.req, "remov");
+            seg.entries.erase(seg.entries.find(*item.req));
+            return pos;
+        }
+    }
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Fixed pool of threads with a bounded queue of tasks.
+// When the queue is full, post() runs the task in the calling thread:
+// producers are slowed down instead of the queue growing without limit.
+// Destruction runs all queued tasks and joins the threads.
+class Executor {
+
+public:
+    using Task = std::function<void()>;
+
+    static constexpr size_t DEFAULT_QUEUE_SIZE = 1024;
+
+    // 0 threads - one per hardware thread
+    Executor(size_t threads = 0, size_t queue_size = DEFAULT_QUEUE_SIZE) : m_queue_size(std::max<size_t>(1, queue_size)) {
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        m_threads.reserve(threads);
+        for (size_t i = 0; i < threads; ++i) {
+            m_threads.emplace_back(&Executor::run, this);
+        }
+    }
+
+    ~Executor() {
+        {
+            std::lock_guard guard(m_mtx);
+            m_stopped = true;
+        }
+        m_cv.notify_all();
+
+        for (auto& t : m_threads) {
+            t.join();
+        }
+    }
+
+    Executor(const Executor&) = delete;
+    Executor(Executor&&) = delete;
+    Executor& operator=(Executor&) = delete;
+    Executor& operator=(Executor&&) = delete;
+
+    void post(Task task) {
+        {
+            std::unique_lock guard(m_mtx);
+            if (m_tasks.size() >= m_queue_size) {
+                guard.unlock();
+                task();
+                return;
+            }
+            m_tasks.push_back(std::move(task));
+        }
+        m_cv.notify_one();
+    }
+
+private:
+    const size_t m_queue_size;
+
+    std::deque<Task> m_tasks;
+    bool m_stopped = false;
+
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+
+    std::vector<std::thread> m_threads;
+
+    void run() {
+        std::unique_lock guard(m_mtx);
+        while (true) {
+            m_cv.wait(guard, [this]() { return m_stopped || !m_tasks.empty(); });
+            if (m_tasks.empty()) {
+                // stopped and nothing left
+                return;
+            }
+
+            auto task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+
+            guard.unlock();
+            task();
+            guard.lock();
+        }
+    }
+};
@@ -0,0 +1,260 @@
+#pragma once
+
+#include "lru.h"
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+
+// Storage for LruCacheCore without per-entry node allocations.
+// Entries live in one contiguous slab (vector of slots, freed slots are
+// reused), recency queues are intrusive doubly linked lists of slot numbers
+// embedded in the slots.
+// Lookup goes through an open addressing index (linear probing, backward
+// shift deletion) of (hash, slot) pairs: most probes compare cached hashes
+// and do not touch the slab at all.
+// A hit is one hash computation, a few probes and relinking of two slots.
+// find() accepts any key comparable with TReq and hashed equally by
+// std::hash (see lookup_key()).
+// Not thread safe, guard outside.
+template<typename TReq, typename TValue>
+class FlatStorage {
+
+public:
+    using Handle = uint32_t;
+
+    Handle end() const {
+        return NIL;
+    }
+
+    size_t size() const {
+        return m_size;
+    }
+
+    template<typename K>
+    Handle find(const K& req) const {
+        if (m_index.empty()) {
+            return NIL;
+        }
+
+        uint32_t hash = hash_of(req);
+        for (size_t pos = hash & m_mask; m_index[pos].slot != NIL; pos = (pos + 1) & m_mask) {
+            auto& bucket = m_index[pos];
+            if (bucket.hash == hash && m_slots[bucket.slot].key == req) {
+                return bucket.slot;
+            }
+        }
+        return NIL;
+    }
+
+    const TReq& key(Handle h) const {
+        return m_slots[h].key;
+    }
+
+    TValue& value(Handle h) {
+        return m_slots[h].value;
+    }
+
+    const TValue& value(Handle h) const {
+        return m_slots[h].value;
+    }
+
+    LruQueue queue(Handle h) const {
+        return m_slots[h].queue;
+    }
+
+    // new entry becomes the most recent one in `queue`,
+    // or the least recent one if `least_recent`
+    Handle insert(const TReq& req, TValue value, LruQueue queue, bool least_recent = false) {
+        if ((m_size + 1) * 100 > m_index.size() * MAX_LOAD_PERCENT) {
+            grow_index();
+        }
+
+        Handle h = m_free;
+        if (h != NIL) {
+            m_free = m_slots[h].next;
+            m_slots[h].key = req;
+            m_slots[h].value = std::move(value);
+        }
+        else {
+            h = static_cast<Handle>(m_slots.size());
+            m_slots.push_back(Slot{req, std::move(value), 0, NIL, NIL, queue});
+        }
+
+        auto& slot = m_slots[h];
+        slot.hash = hash_of(req);
+        if (least_recent) {
+            link_back(h, queue);
+        }
+        else {
+            link_front(h, queue);
+        }
+
+        size_t pos = slot.hash & m_mask;
+        while (m_index[pos].slot != NIL) {
+            pos = (pos + 1) & m_mask;
+        }
+        m_index[pos] = Bucket{slot.hash, h};
+        ++m_size;
+
+        return h;
+    }
+
+    // entry becomes the most recent one in `queue`
+    void touch(Handle h, LruQueue queue) {
+        if (m_heads[queue] == h) {
+            return;
+        }
+        unlink(h);
+        link_front(h, queue);
+    }
+
+    // the least recent entry in `queue`, end() if it is empty
+    Handle back(LruQueue queue) const {
+        return m_tails[queue];
+    }
+
+    void erase(Handle h) {
+        auto& slot = m_slots[h];
+
+        size_t pos = slot.hash & m_mask;
+        while (m_index[pos].slot != h) {
+            pos = (pos + 1) & m_mask;
+        }
+        remove_from_index(pos);
+
+        unlink(h);
+        // release memory held by the entry right away
+        slot.key = TReq();
+        slot.value = TValue();
+        slot.next = m_free;
+        m_free = h;
+        --m_size;
+    }
+
+    // calls f(handle) for every entry in `queue` from the most recent one,
+    // f must not change the storage
+    template<typename F>
+    void for_each(LruQueue queue, const F& f) const {
+        for (Handle h = m_heads[queue]; h != NIL; h = m_slots[h].next) {
+            f(h);
+        }
+    }
+
+private:
+    static constexpr Handle NIL = UINT32_MAX;
+    static constexpr size_t MAX_LOAD_PERCENT = 70;
+    static constexpr size_t MIN_INDEX_SIZE = 16;
+
+    struct Slot {
+        TReq key;
+        TValue value;
+        uint32_t hash;
+        // neighbours in the recency queue, `next` links free slots too
+        Handle prev;
+        Handle next;
+        LruQueue queue;
+    };
+
+    struct Bucket {
+        uint32_t hash;
+        Handle slot;
+    };
+
+    std::vector<Slot> m_slots;
+    Handle m_free = NIL;
+    size_t m_size = 0;
+
+    // size is a power of two
+    std::vector<Bucket> m_index;
+    size_t m_mask = 0;
+
+    Handle m_heads[2] = {NIL, NIL};
+    Handle m_tails[2] = {NIL, NIL};
+
+    template<typename K>
+    static uint32_t hash_of(const K& req) {
+        // spread the bits, std::hash is identity for integers
+        uint64_t h = static_cast<uint64_t>(LruHash()(req)) * 0x9E3779B97F4A7C15ull;
+        return static_cast<uint32_t>(h >> 32);
+    }
+
+    void link_front(Handle h, LruQueue queue) {
+        auto& slot = m_slots[h];
+        slot.queue = queue;
+        slot.prev = NIL;
+        slot.next = m_heads[queue];
+
+        if (m_heads[queue] != NIL) {
+            m_slots[m_heads[queue]].prev = h;
+        }
+        else {
+            m_tails[queue] = h;
+        }
+        m_heads[queue] = h;
+    }
+
+    void link_back(Handle h, LruQueue queue) {
+        auto& slot = m_slots[h];
+        slot.queue = queue;
+        slot.prev = m_tails[queue];
+        slot.next = NIL;
+
+        if (m_tails[queue] != NIL) {
+            m_slots[m_tails[queue]].next = h;
+        }
+        else {
+            m_heads[queue] = h;
+        }
+        m_tails[queue] = h;
+    }
+
+    void unlink(Handle h) {
+        auto& slot = m_slots[h];
+
+        if (slot.prev != NIL) {
+            m_slots[slot.prev].next = slot.next;
+        }
+        else {
+            m_heads[slot.queue] = slot.next;
+        }
+
+        if (slot.next != NIL) {
+            m_slots[slot.next].prev = slot.prev;
+        }
+        else {
+            m_tails[slot.queue] = slot.prev;
+        }
+    }
+
+    void remove_from_index(size_t hole) {
+        // shift back the following buckets of the probe sequence,
+        // so lookups never need tombstones
+        for (size_t pos = (hole + 1) & m_mask; m_index[pos].slot != NIL; pos = (pos + 1) & m_mask) {
+            size_t home = m_index[pos].hash & m_mask;
+            if (((pos - home) & m_mask) >= ((pos - hole) & m_mask)) {
+                m_index[hole] = m_index[pos];
+                hole = pos;
+            }
+        }
+        m_index[hole].slot = NIL;
+    }
+
+    void grow_index() {
+        std::vector<Bucket> old(std::max(MIN_INDEX_SIZE, m_index.size() * 2), Bucket{0, NIL});
+        old.swap(m_index);
+        m_mask = m_index.size() - 1;
+
+        for (auto& bucket : old) {
+            if (bucket.slot == NIL) {
+                continue;
+            }
+            size_t pos = bucket.hash & m_mask;
+            while (m_index[pos].slot != NIL) {
+                pos = (pos + 1) & m_mask;
+            }
+            m_index[pos] = bucket;
+        }
+    }
+};
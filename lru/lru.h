@@ -1,10 +1,27 @@
+#pragma once
+
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <list>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
 #include <thread>
 #include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "background_worker.h"
+#include "executor.h"
+#include "stats.h"
 
 
 #ifdef TEST_OUT
@@ -14,103 +31,954 @@
 #endif
 
 
+// Key a request is looked up by: string requests are searched by
+// std::string_view, so a hit does not need to construct a std::string.
+// Other requests are searched as is (K has to be comparable with TReq).
+template<typename TReq, typename K>
+decltype(auto) lookup_key(const K& req) {
+    if constexpr (std::is_same_v<TReq, std::string> && std::is_convertible_v<const K&, std::string_view>) {
+        return std::string_view(req);
+    }
+    else {
+        return (req);
+    }
+}
+
+// Transparent std::hash: std::hash<std::string_view> gives the same value
+// as std::hash<std::string>, so lookup keys and requests hash equally.
+struct LruHash {
+    template<typename K>
+    size_t operator()(const K& key) const {
+        return std::hash<K>()(key);
+    }
+};
+
+
+// Every entry weighs 1, so the capacity is the number of entries.
+struct UnitWeigher {
+    template<typename TReq, typename TRep>
+    size_t operator()(const TReq& /*req*/, const TRep& /*rep*/) const {
+        return 1;
+    }
+};
+
+// Entry weighs the bytes of its string-like request and reply,
+// so the capacity is a memory budget.
+struct ByteWeigher {
+    template<typename TReq, typename TRep>
+    size_t operator()(const TReq& req, const TRep& rep) const {
+        return req.size() + rep.size();
+    }
+};
+
+
+// Admits every new entry, the cache is pure LRU.
+struct AdmitAll {
+    // part of capacity reserved for new entries before admission
+    size_t window_size(size_t /*capacity*/) const {
+        return 0;
+    }
+
+    // called on every request (hit or miss) with its lookup key
+    template<typename K>
+    void record(const K& /*req*/) {}
+
+    // should `candidate` leaving the window replace `victim`, the LRU entry of the main part
+    template<typename TReq>
+    bool admit(const TReq& /*candidate*/, const TReq& /*victim*/) const {
+        return true;
+    }
+};
+
+
+// Freshness of cached replies.
+struct LruTtl {
+    static constexpr std::chrono::milliseconds DEFAULT_SWEEP_PERIOD{1000};
+
+    // replies never expire
+    LruTtl() = default;
+
+    // replies expire `ttl_` after generation, expired ones are removed on
+    // lookup or by the background sweeper every `sweep_period_`;
+    // within `stale_` after expiry a lookup still returns the old reply while
+    // a single background refresh generates the new one (stale-while-revalidate)
+    LruTtl(std::chrono::milliseconds ttl_, std::chrono::milliseconds stale_ = {}, std::chrono::milliseconds sweep_period_ = DEFAULT_SWEEP_PERIOD) :
+        ttl(ttl_), stale(stale_), sweep_period(sweep_period_)
+    {}
+
+    bool enabled() const {
+        return ttl.count() > 0;
+    }
+
+    std::chrono::milliseconds ttl{0};
+    std::chrono::milliseconds stale{0};
+    std::chrono::milliseconds sweep_period{DEFAULT_SWEEP_PERIOD};
+};
+
+
+// Settings of the executor generating replies for make_request_async().
+// The executor is started on the first asynchronous request.
+struct LruAsync {
+    LruAsync() = default;
+
+    // 0 threads - one per hardware thread; when `queue_size_` misses are
+    // waiting, the next one is generated in the requesting thread
+    LruAsync(size_t threads_, size_t queue_size_ = Executor::DEFAULT_QUEUE_SIZE) :
+        threads(threads_), queue_size(queue_size_)
+    {}
+
+    size_t threads = 0;
+    size_t queue_size = Executor::DEFAULT_QUEUE_SIZE;
+};
+
+
+// Recency queues of a cache storage.
+enum LruQueue : uint8_t {
+    LRU_WINDOW = 0,     // new entries, see Admission::window_size()
+    LRU_MAIN = 1,
+};
+
+
+// Second level of a cache: keeps replies evicted from memory, a miss looks
+// there before generating the reply (see SpillTier). Thread safe.
 template<typename TReq, typename TRep>
-class LruCache {
+class LruTier {
 
 public:
-    LruCache(size_t size) : m_max_size(size) {}
+    virtual ~LruTier() = default;
 
-    virtual ~LruCache() = default;
-    LruCache(const LruCache&) = delete;
-    LruCache(LruCache&&) = delete;
-    LruCache& operator=(LruCache&) = delete;
-    LruCache& operator=(LruCache&&) = delete;
+    // called under the cache lock, must be quick
+    virtual void put(const TReq& req, const std::shared_ptr<const TRep>& reply) = 0;
+
+    // nullopt if the reply is not stored (or can not be read)
+    virtual std::optional<TRep> get(const TReq& req) = 0;
+};
+
+
+// Cached entry with its place in the cache, see LruCacheCore::dump()
+template<typename TReq, typename TRep>
+struct LruDumpEntry {
+    TReq req;
+    std::shared_ptr<const TRep> reply;
+    std::chrono::steady_clock::time_point expires;
+    LruQueue queue;
+};
+
+
+// Default storage of LruCacheCore: ordered map of entries
+// + recency queue (list of map iterators) per LruQueue.
+// find() accepts any key comparable with TReq (see lookup_key()).
+// Not thread safe, guard outside.
+template<typename TReq, typename TValue>
+class MapStorage {
+
+    struct DeclT {
+        using CacheType = std::map<TReq, std::tuple<TValue, DeclT>, std::less<>>;
+        using QueueType = std::list<typename CacheType::iterator>;
+
+        typename QueueType::iterator it;
+        LruQueue queue;
+    };
+
+public:
+    using Handle = typename DeclT::CacheType::iterator;
+
+    Handle end() {
+        return m_cache.end();
+    }
+
+    size_t size() const {
+        return m_cache.size();
+    }
+
+    template<typename K>
+    Handle find(const K& req) {
+        return m_cache.find(req);
+    }
+
+    const TReq& key(Handle h) const {
+        return h->first;
+    }
+
+    TValue& value(Handle h) {
+        return std::get<0>(h->second);
+    }
+
+    const TValue& value(Handle h) const {
+        return std::get<0>(h->second);
+    }
+
+    LruQueue queue(Handle h) const {
+        return std::get<1>(h->second).queue;
+    }
+
+    // new entry becomes the most recent one in `queue`,
+    // or the least recent one if `least_recent`
+    Handle insert(const TReq& req, TValue value, LruQueue queue, bool least_recent = false) {
+        auto [it, added] = m_cache.emplace(req, std::make_tuple(std::move(value), DeclT{m_queues[queue].end(), queue}));
+        assert(added && "Implementation error!");
+
+        if (least_recent) {
+            m_queues[queue].push_back(it);
+            std::get<1>(it->second).it = std::prev(m_queues[queue].end());
+        }
+        else {
+            m_queues[queue].push_front(it);
+            std::get<1>(it->second).it = m_queues[queue].begin();
+        }
+
+        return it;
+    }
+
+    // entry becomes the most recent one in `queue`
+    void touch(Handle h, LruQueue queue) {
+        auto& decl = std::get<1>(h->second);
 
-    TRep make_request(const TReq& req) {
-        {
-            // search in cache
-            std::lock_guard guard(m_mtx);
+        m_queues[queue].splice(m_queues[queue].begin(), m_queues[decl.queue], decl.it);
+        decl.queue = queue;
+    }
+
+    // the least recent entry in `queue`, end() if it is empty
+    Handle back(LruQueue queue) {
+        return m_queues[queue].empty() ? m_cache.end() : m_queues[queue].back();
+    }
+
+    void erase(Handle h) {
+        auto& decl = std::get<1>(h->second);
+
+        m_queues[decl.queue].erase(decl.it);
+        m_cache.erase(h);
+    }
+
+    // calls f(handle) for every entry in `queue` from the most recent one,
+    // f must not change the storage
+    template<typename F>
+    void for_each(LruQueue queue, const F& f) const {
+        for (auto h : m_queues[queue]) {
+            f(h);
+        }
+    }
+
+private:
+    // key: request
+    // value: tuple(value, iterator_to_queue)
+    typename DeclT::CacheType m_cache;
+
+    // queues of request, each item is reference to request in map
+    typename DeclT::QueueType m_queues[2];
+};
+
+
+// Single locked LRU: storage of replies + recency queues under one mutex.
+// Reply generation is passed by the owner, so the same core serves
+// LruCache and every shard of ShardedLruCache.
+// Concurrent misses on the same request are coalesced: the first one
+// generates the reply, the others wait for it (or for its exception).
+// Replies are kept as immutable shared buffers: a hit only copies a pointer
+// under the lock, and eviction does not free a reply someone still holds.
+// Capacity is measured by Weigher: the least recently used entries are
+// evicted until the total weight fits.
+// New entries go to a window LRU first (Admission::window_size() of the
+// capacity), entries pushed out of the window enter the main LRU only if
+// Admission prefers them to the main LRU victim. With AdmitAll the window
+// is empty and everything is admitted, i.e. plain LRU.
+// Storage keeps the entries and their order, see MapStorage for the interface.
+// With LruTtl replies expire: an expired one is dropped on lookup (or by
+// sweep()) and the request is a miss, in stale-while-revalidate mode it is
+// returned and refreshed in background, through the worker of the owner.
+// Requests are looked up by lookup_key(), a request is copied to TReq
+// only on a miss.
+// With LruTier evicted replies go to the tier, a miss is looked up there
+// before prepare_reply (outside the lock, coalesced like a generation).
+template<typename TReq, typename TRep, typename Weigher = UnitWeigher, typename Admission = AdmitAll,
+         template<typename, typename> class Storage = MapStorage>
+class LruCacheCore {
+
+public:
+    using ReplyPtr = std::shared_ptr<const TRep>;
+
+    // `background` runs stale-while-revalidate refreshes, required in this mode only
+    LruCacheCore(size_t size, Weigher weigher = Weigher(), Admission admission = Admission(),
+                 LruTtl ttl = LruTtl(), BackgroundWorker* background = nullptr, LruTier<TReq, TRep>* tier = nullptr) :
+        m_max_size(size),
+        m_weigher(std::move(weigher)),
+        m_ttl(ttl),
+        m_background(background),
+        m_tier(tier),
+        m_admission(std::move(admission)),
+        m_window_max_size(std::min(m_admission.window_size(size), size))
+    {
+        assert((m_ttl.stale.count() == 0 || m_background) && "stale-while-revalidate requires background worker");
+        // a reply read back from the tier would get a new expiry
+        assert((!m_ttl.enabled() || !m_tier) && "second tier does not support TTL");
+    }
+
+    LruCacheCore(const LruCacheCore&) = delete;
+    LruCacheCore(LruCacheCore&&) = delete;
+    LruCacheCore& operator=(LruCacheCore&) = delete;
+    LruCacheCore& operator=(LruCacheCore&&) = delete;
+
+    // called with the reply or with the error of its generation;
+    // must not throw, may be called in the requesting thread (on a hit)
+    // or in the thread which generated the reply
+    using Callback = std::function<void(ReplyPtr, std::exception_ptr)>;
+
+    template<typename K, typename Gen>
+    ReplyPtr make_request(const K& key, const Gen& prepare_reply) {
+        auto found = lookup(key, prepare_reply, nullptr);
+
+        if (found.reply) {
+            return found.reply;
+        }
+        if (!found.owned_req) {
+            INFO(lookup_key<TReq>(key), "wait");
+            return found.future.get();
+        }
+
+        return generate_reply(*found.owned_req, prepare_reply, *found.promise);
+    }
+
+    // on a miss the reply is generated by `executor`
+    template<typename K, typename Gen>
+    std::shared_future<ReplyPtr> make_request_async(const K& key, const Gen& prepare_reply, Executor& executor) {
+        auto found = lookup(key, prepare_reply, nullptr);
+
+        if (found.reply) {
+            std::promise<ReplyPtr> ready;
+            ready.set_value(std::move(found.reply));
+            return ready.get_future().share();
+        }
+        if (found.owned_req) {
+            start_generation(std::move(*found.owned_req), prepare_reply, std::move(found.promise), executor);
+        }
+
+        return found.future;
+    }
+
+    // on a hit `on_reply` is called right away, on a miss after generation by `executor`
+    template<typename K, typename Gen>
+    void make_request_async(const K& key, const Gen& prepare_reply, Executor& executor, Callback on_reply) {
+        auto found = lookup(key, prepare_reply, &on_reply);
+
+        if (found.reply) {
+            on_reply(std::move(found.reply), nullptr);
+            return;
+        }
+        if (found.owned_req) {
+            start_generation(std::move(*found.owned_req), prepare_reply, std::move(found.promise), executor);
+        }
+    }
+
+    // result of the search in cache, one of:
+    struct Lookup {
+        // hit
+        ReplyPtr reply;
+        // generation is in progress in another thread, `future` is its result
+        std::shared_future<ReplyPtr> future;
+        // miss, the caller must generate the reply and fulfil `promise`
+        std::optional<TReq> owned_req;
+        std::shared_ptr<std::promise<ReplyPtr>> promise;
+    };
+
+    struct BatchMiss {
+        // position in the batch
+        size_t index;
+        Lookup found;
+    };
+
+    // A batch is resolved in three steps, so an owner with several locks can
+    // look up keys under all of them before generating anything:
+    // lookup_batch() looks up keys[i] for every i in `indices` under one lock,
+    // hits go to replies[i], the rest is returned;
+    // generate_batch() generates replies of the misses the batch owns
+    // (in parallel with `executor` if given);
+    // wait_batch() puts replies of all misses to `replies`, throws the error
+    // of the first failed one.
+    template<typename Keys, typename Gen>
+    std::vector<BatchMiss> lookup_batch(const Keys& keys, const std::vector<size_t>& indices, std::vector<ReplyPtr>& replies, const Gen& prepare_reply) {
+        auto now = m_ttl.enabled() ? Clock::now() : Clock::time_point();
+
+        std::vector<BatchMiss> ret;
 
-            if (auto it = m_cache.find(req); it != m_cache.end()) {
-                INFO(it->first, "found");
-                update_request_queue(it);
+        auto guard = lock();
+        for (auto i : indices) {
+            auto found = lookup_locked(keys[i], now, prepare_reply, nullptr);
+            if (found.reply) {
+                replies[i] = std::move(found.reply);
+            }
+            else {
+                ret.push_back(BatchMiss{i, std::move(found)});
+            }
+        }
+        return ret;
+    }
+
+    template<typename Gen>
+    void generate_batch(std::vector<BatchMiss>& misses, const Gen& prepare_reply, Executor* executor) {
+        // every owned promise has to be fulfilled, errors are delivered through them
+        BatchMiss* inline_miss = nullptr;
+        for (auto& miss : misses) {
+            if (!miss.found.owned_req) {
+                continue;
+            }
+            if (!executor) {
+                try {
+                    generate_reply(*miss.found.owned_req, prepare_reply, *miss.found.promise);
+                }
+                catch (...) {
+                    // rethrown by wait_batch()
+                }
+                continue;
+            }
+            // the calling thread generates one reply itself
+            if (inline_miss) {
+                start_generation(std::move(*inline_miss->found.owned_req), prepare_reply, std::move(inline_miss->found.promise), *executor);
+            }
+            inline_miss = &miss;
+        }
 
-                return std::get<0>(it->second);
+        if (inline_miss) {
+            try {
+                generate_reply(*inline_miss->found.owned_req, prepare_reply, *inline_miss->found.promise);
+            }
+            catch (...) {
+                // rethrown by wait_batch()
             }
         }
+    }
 
-        return add_new_item_in_cache(req);
+    static void wait_batch(const std::vector<BatchMiss>& misses, std::vector<ReplyPtr>& replies) {
+        for (auto& miss : misses) {
+            replies[miss.index] = miss.found.future.get();
+        }
     }
 
-protected:
-    virtual TRep prepare_reply(const TReq& req) const;
+    // capacity in weight units
+    size_t max_size() const {
+        return m_max_size;
+    }
+
+    // number of cached entries
+    size_t size() const {
+        std::lock_guard guard(m_mtx);
+        return m_storage.size();
+    }
+
+    // total weight of cached entries
+    size_t weight() const {
+        std::lock_guard guard(m_mtx);
+        return m_weight;
+    }
+
+    // removes entries which can not be returned anymore (expired and out of stale period)
+    void sweep() {
+        if (!m_ttl.enabled()) {
+            return;
+        }
+        auto now = Clock::now();
+
+        std::lock_guard guard(m_mtx);
+
+        std::vector<typename Storage<TReq, Entry>::Handle> dead;
+        auto collect = [this, now, &dead](auto h) {
+            if (now >= m_storage.value(h).expires + m_ttl.stale) {
+                dead.push_back(h);
+            }
+        };
+        m_storage.for_each(LRU_WINDOW, collect);
+        m_storage.for_each(LRU_MAIN, collect);
+
+        for (auto h : dead) {
+            INFO(m_storage.key(h), "expir");
+            erase(h);
+        }
+        m_stats.add(LruStats::EXPIRATIONS, dead.size());
+    }
+
+    // counters since construction
+    LruStatsSnapshot stats() const {
+        return m_stats.snapshot();
+    }
+
+    using DumpEntry = LruDumpEntry<TReq, TRep>;
+
+    // all entries, the most recent first in each queue;
+    // replies are shared, not copied
+    std::vector<DumpEntry> dump() const {
+        std::lock_guard guard(m_mtx);
+
+        std::vector<DumpEntry> ret;
+        ret.reserve(m_storage.size());
+        auto add = [this, &ret](auto h) {
+            auto& entry = m_storage.value(h);
+            ret.push_back(DumpEntry{m_storage.key(h), entry.reply, entry.expires, m_storage.queue(h)});
+        };
+        m_storage.for_each(LRU_WINDOW, add);
+        m_storage.for_each(LRU_MAIN, add);
+        return ret;
+    }
+
+    // adds entries in order given by dump() behind the cached ones, so
+    // over the capacity restored entries are evicted first; window entries
+    // the window has no room for go to the main queue.
+    // Skips requests cached already and replies expired for good;
+    // expiry is limited by the current TTL
+    void restore(const std::vector<DumpEntry>& entries) {
+        auto now = Clock::now();
+
+        std::lock_guard guard(m_mtx);
+
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            auto expires = Clock::time_point::max();
+            if (m_ttl.enabled()) {
+                expires = std::min(it->expires, now + m_ttl.ttl);
+                if (now >= expires + m_ttl.stale) {
+                    continue;
+                }
+            }
+            if (m_storage.find(it->req) != m_storage.end() || m_in_flight.find(it->req) != m_in_flight.end()) {
+                continue;
+            }
+
+            size_t weight = m_weigher(it->req, *it->reply);
+            // a full window would push restored entries in front of the main queue
+            auto queue = it->queue;
+            if (queue == LRU_WINDOW && m_window_weight + weight > m_window_max_size) {
+                queue = LRU_MAIN;
+            }
+            m_storage.insert(it->req, Entry{it->reply, weight, expires}, queue, true);
+            m_weight += weight;
+            if (queue == LRU_WINDOW) {
+                m_window_weight += weight;
+            }
+            INFO(it->req, "restr");
+        }
+
+        remove_item_from_cache_if_need();
+    }
 
 private:
+    using Clock = std::chrono::steady_clock;
+
     const size_t m_max_size = 0;
+    const Weigher m_weigher;
+    const LruTtl m_ttl;
+    BackgroundWorker* const m_background = nullptr;
+    LruTier<TReq, TRep>* const m_tier = nullptr;
 
-    struct DeclT {
-        using CacheType = std::map<TReq, std::tuple<TRep, DeclT>>;
-        using QueueType = std::list<typename CacheType::iterator>;
+    // guarded by m_mtx
+    Admission m_admission;
+    const size_t m_window_max_size = 0;
 
-        typename QueueType::iterator it;
+    struct Entry {
+        ReplyPtr reply;
+        size_t weight;
+        Clock::time_point expires;
     };
 
-    using CacheIterator = typename DeclT::CacheType::iterator;
+    // guarded by m_mtx
+    Storage<TReq, Entry> m_storage;
 
-    // key: request
-    // value: tuple(reply, iterator_to_queue)
-    typename DeclT::CacheType m_cache;
+    struct InFlight {
+        std::shared_future<ReplyPtr> future;
+        // asynchronous waiters
+        std::vector<Callback> callbacks;
+    };
+
+    // requests whose replies are being generated, guarded by m_mtx
+    std::map<TReq, InFlight, std::less<>> m_in_flight;
+
+    // sum of weights in m_storage and in its window queue, guarded by m_mtx
+    size_t m_weight = 0;
+    size_t m_window_weight = 0;
+
+    mutable std::mutex m_mtx;
 
-    // queue of request, each item is reference to request in map
-    typename DeclT::QueueType m_req_queue;
+    LruStats m_stats;
 
-    std::mutex m_mtx;
+    // the clock is read only when the mutex is busy
+    std::unique_lock<std::mutex> lock() {
+        std::unique_lock guard(m_mtx, std::try_to_lock);
+        if (guard.owns_lock()) {
+            m_stats.record(LruStats::LOCK_WAIT, {});
+        }
+        else {
+            auto start = Clock::now();
+            guard.lock();
+            m_stats.record(LruStats::LOCK_WAIT, Clock::now() - start);
+        }
+        return guard;
+    }
 
-    void update_request_queue(CacheIterator & cache_it) {
+    // `on_reply` if given is registered to be called when an in-flight reply is ready
+    template<typename K, typename Gen>
+    Lookup lookup(const K& key, const Gen& prepare_reply, Callback* on_reply) {
+        // no clock calls without TTL
+        auto now = m_ttl.enabled() ? Clock::now() : Clock::time_point();
+
+        auto guard = lock();
+        return lookup_locked(key, now, prepare_reply, on_reply);
+    }
+
+    template<typename K, typename Gen>
+    Lookup lookup_locked(const K& key, Clock::time_point now, const Gen& prepare_reply, Callback* on_reply) {
         // guard outside
 
-        auto& queue_it = std::get<1>(cache_it->second).it;
+        const auto& req = lookup_key<TReq>(key);
+
+        Lookup ret;
+
+        // search in cache
+        m_admission.record(req);
+
+        if (auto h = m_storage.find(req); h != m_storage.end()) {
+            auto& entry = m_storage.value(h);
 
-        if (queue_it != m_req_queue.end()) {
-            m_req_queue.erase(queue_it);
+            if (now < entry.expires) {
+                INFO(m_storage.key(h), "found");
+                m_stats.add(LruStats::HITS);
+                m_storage.touch(h, m_storage.queue(h));
+
+                ret.reply = entry.reply;
+                return ret;
+            }
+
+            if (now < entry.expires + m_ttl.stale) {
+                INFO(m_storage.key(h), "stale");
+                m_stats.add(LruStats::STALE_HITS);
+                m_storage.touch(h, m_storage.queue(h));
+
+                if (m_in_flight.find(req) == m_in_flight.end()) {
+                    start_refresh(TReq(req), prepare_reply);
+                }
+                ret.reply = entry.reply;
+                return ret;
+            }
+
+            INFO(m_storage.key(h), "expir");
+            m_stats.add(LruStats::EXPIRATIONS);
+            erase(h);
+        }
+
+        // search in replies being generated right now
+        auto it = m_in_flight.find(req);
+        if (it == m_in_flight.end()) {
+            // the promise is needed on a miss only, a hit allocates nothing
+            ret.owned_req.emplace(req);
+            ret.promise = std::make_shared<std::promise<ReplyPtr>>();
+            it = m_in_flight.emplace(*ret.owned_req, InFlight{ret.promise->get_future().share(), {}}).first;
+            m_stats.add(LruStats::MISSES);
+        }
+        else {
+            m_stats.add(LruStats::COALESCED);
         }
-        m_req_queue.push_front(cache_it);
-        queue_it = m_req_queue.begin();
+
+        ret.future = it->second.future;
+        if (on_reply) {
+            it->second.callbacks.push_back(std::move(*on_reply));
+        }
+        return ret;
     }
 
-    TRep add_new_item_in_cache(const TReq& req) {
-        TRep reply = prepare_reply(req);
+    template<typename Gen>
+    void start_generation(TReq req, const Gen& prepare_reply, std::shared_ptr<std::promise<ReplyPtr>> promise, Executor& executor) {
+        executor.post([this, req = std::move(req), prepare_reply, promise = std::move(promise)]() {
+            try {
+                generate_reply(req, prepare_reply, *promise);
+            }
+            catch (...) {
+                // delivered to the waiters
+            }
+        });
+    }
+
+    template<typename Gen>
+    void start_refresh(TReq req, const Gen& prepare_reply) {
+        // guard outside
+
+        auto promise = std::make_shared<std::promise<ReplyPtr>>();
+        m_in_flight.emplace(req, InFlight{promise->get_future().share(), {}});
+
+        m_background->post([this, req = std::move(req), prepare_reply, promise]() {
+            try {
+                generate_reply(req, prepare_reply, *promise);
+            }
+            catch (...) {
+                // keep the stale reply, next lookup tries again
+            }
+        });
+    }
 
-        {
-            std::lock_guard guard(m_mtx);
+    template<typename Gen>
+    ReplyPtr generate_reply(const TReq& req, const Gen& prepare_reply, std::promise<ReplyPtr>& promise) {
+        ReplyPtr reply;
+        auto start = Clock::now();
+        try {
+            std::optional<TRep> stored;
+            if (m_tier) {
+                stored = m_tier->get(req);
+            }
+            if (stored) {
+                m_stats.add(LruStats::TIER_HITS);
+                reply = std::make_shared<const TRep>(std::move(*stored));
+            }
+            else {
+                reply = std::make_shared<const TRep>(prepare_reply(req));
+            }
+            m_stats.record(LruStats::GENERATION, Clock::now() - start);
+        }
+        catch (...) {
+            auto error = std::current_exception();
+            m_stats.record(LruStats::GENERATION, Clock::now() - start);
+            m_stats.add(LruStats::GENERATION_ERRORS);
 
-            auto [it, added] = m_cache.emplace(req, std::make_tuple(TRep(), DeclT{m_req_queue.end()}));
-            if (added) {
-                // may be inserted in another thread
-                std::get<0>(it->second) = std::move(reply);
+            // waiters get the same error
+            auto callbacks = leave_in_flight(req);
+            promise.set_exception(error);
+            for (auto& on_reply : callbacks) {
+                on_reply(nullptr, error);
             }
-            update_request_queue(it);
+            throw;
+        }
+
+        auto callbacks = add_new_item_in_cache(req, reply, m_weigher(req, *reply));
+        promise.set_value(reply);
+        for (auto& on_reply : callbacks) {
+            on_reply(reply, nullptr);
+        }
 
-            INFO(req, "added");
+        return reply;
+    }
 
-            remove_item_from_cache_if_need();
+    // returns callbacks of asynchronous waiters
+    std::vector<Callback> leave_in_flight(const TReq& req) {
+        auto guard = lock();
+        return extract_in_flight(req);
+    }
+
+    std::vector<Callback> extract_in_flight(const TReq& req) {
+        // guard outside
 
-            return std::get<0>(it->second);
+        std::vector<Callback> ret;
+        if (auto it = m_in_flight.find(req); it != m_in_flight.end()) {
+            ret = std::move(it->second.callbacks);
+            m_in_flight.erase(it);
         }
+        return ret;
+    }
+
+    // returns callbacks of asynchronous waiters
+    std::vector<Callback> add_new_item_in_cache(const TReq& req, const ReplyPtr& reply, size_t weight) {
+        auto guard = lock();
+
+        // the request leaves in-flight state and appears in cache atomically,
+        // so no one else can start generating it again in between
+        auto callbacks = extract_in_flight(req);
+
+        auto expires = m_ttl.enabled() ? Clock::now() + m_ttl.ttl : Clock::time_point::max();
+
+        // stale entry is replaced by refresh
+        if (auto h = m_storage.find(req); h != m_storage.end()) {
+            erase(h);
+        }
+
+        m_storage.insert(req, Entry{reply, weight, expires}, LRU_WINDOW);
+        m_weight += weight;
+        m_window_weight += weight;
+
+        INFO(req, "added");
+
+        remove_item_from_cache_if_need();
+
+        return callbacks;
     }
 
     void remove_item_from_cache_if_need() {
         // guard outside
 
-        assert(m_req_queue.size() == m_cache.size() && "Implementation error!");
+        // LRU entries of the window either move to the main queue or are dropped
+        while (m_window_weight > m_window_max_size) {
+            auto h = m_storage.back(LRU_WINDOW);
+            assert(h != m_storage.end() && "Implementation error!");
+
+            size_t weight = m_storage.value(h).weight;
+            m_window_weight -= weight;
+
+            auto victim = m_storage.back(LRU_MAIN);
+            if (m_weight > m_max_size && victim != m_storage.end() && !m_admission.admit(m_storage.key(h), m_storage.key(victim))) {
+                INFO(m_storage.key(h), "rejct");
+                m_stats.add(LruStats::REJECTIONS);
+                m_weight -= weight;
+                m_storage.erase(h);
+                continue;
+            }
+
+            m_storage.touch(h, LRU_MAIN);
+        }
+
+        // an entry heavier than the whole capacity is evicted right away,
+        // the caller still gets its reply
+        while (m_weight > m_max_size) {
+            auto h = m_storage.back(LRU_MAIN);
+            if (h == m_storage.end()) {
+                h = m_storage.back(LRU_WINDOW);
+            }
+            assert(h != m_storage.end() && "Implementation error!");
+
+            INFO(m_storage.key(h), "remov");
+            m_stats.add(LruStats::EVICTIONS);
+            if (m_tier) {
+                m_tier->put(m_storage.key(h), m_storage.value(h).reply);
+            }
+            erase(h);
+        }
+    }
+
+    void erase(typename Storage<TReq, Entry>::Handle h) {
+        // guard outside
+
+        size_t weight = m_storage.value(h).weight;
+        m_weight -= weight;
+        if (m_storage.queue(h) == LRU_WINDOW) {
+            m_window_weight -= weight;
+        }
+        m_storage.erase(h);
+    }
+};
+
+
+template<typename TReq, typename TRep, typename Weigher = UnitWeigher, typename Admission = AdmitAll,
+         template<typename, typename> class Storage = MapStorage>
+class LruCache {
+
+public:
+    using ReplyPtr = typename LruCacheCore<TReq, TRep, Weigher, Admission, Storage>::ReplyPtr;
+    using Callback = typename LruCacheCore<TReq, TRep, Weigher, Admission, Storage>::Callback;
 
-        if (m_cache.size() > m_max_size) {
-            auto it = m_req_queue.back();
-            m_req_queue.pop_back();
+    // `tier` keeps evicted replies, shared with whoever else uses it
+    LruCache(size_t size, Weigher weigher = Weigher(), Admission admission = Admission(), LruTtl ttl = LruTtl(), LruAsync async = LruAsync(),
+             std::shared_ptr<LruTier<TReq, TRep>> tier = nullptr) :
+        m_async(async),
+        m_tier(std::move(tier)),
+        m_background(ttl.enabled() ? std::make_unique<BackgroundWorker>(ttl.sweep_period, [this]() { m_core.sweep(); }) : nullptr),
+        m_core(size, std::move(weigher), std::move(admission), ttl, m_background.get(), m_tier.get())
+    {
+        if (m_background) {
+            m_background->start();
+        }
+    }
 
-            assert(it != m_cache.end() && "Implementation error!");
-            m_cache.erase(it);
-            INFO(it->first, "remov");
+    virtual ~LruCache() {
+        // asynchronous generations and background refreshes use prepare_reply,
+        // generations still queued are completed
+        m_executor.reset();
+        if (m_background) {
+            m_background->stop();
         }
     }
-};
\ No newline at end of file
+
+    LruCache(const LruCache&) = delete;
+    LruCache(LruCache&&) = delete;
+    LruCache& operator=(LruCache&) = delete;
+    LruCache& operator=(LruCache&&) = delete;
+
+    // reply is copied outside of the cache lock;
+    // `req` is TReq or any key lookup_key() accepts, e.g. std::string_view
+    template<typename K = TReq>
+    TRep make_request(const K& req) {
+        return *make_shared_request(req);
+    }
+
+    // no copy at all, the reply stays valid after eviction
+    template<typename K = TReq>
+    ReplyPtr make_shared_request(const K& req) {
+        return m_core.make_request(req, [this](const TReq& r) { return prepare_reply(r); });
+    }
+
+    // replies in order of `reqs`, a random access container of TReq or
+    // lookup keys; see make_shared_requests()
+    template<typename Keys>
+    std::vector<TRep> make_requests(const Keys& reqs, bool parallel = false) {
+        std::vector<TRep> ret;
+        ret.reserve(reqs.size());
+        for (auto& reply : make_shared_requests(reqs, parallel)) {
+            ret.push_back(*reply);
+        }
+        return ret;
+    }
+
+    // all hits are found under one lock, misses are generated by this thread
+    // (with `parallel` - by the executor and this thread); the first error
+    // is rethrown after all misses are done
+    template<typename Keys>
+    std::vector<ReplyPtr> make_shared_requests(const Keys& reqs, bool parallel = false) {
+        auto gen = [this](const TReq& r) { return prepare_reply(r); };
+
+        std::vector<size_t> indices(reqs.size());
+        for (size_t i = 0; i < indices.size(); ++i) {
+            indices[i] = i;
+        }
+
+        std::vector<ReplyPtr> ret(reqs.size());
+        auto misses = m_core.lookup_batch(reqs, indices, ret, gen);
+        m_core.generate_batch(misses, gen, parallel && misses.size() > 1 ? &executor() : nullptr);
+        m_core.wait_batch(misses, ret);
+        return ret;
+    }
+
+    // a hit returns a ready future, a miss is generated by the executor
+    template<typename K = TReq>
+    std::shared_future<ReplyPtr> make_request_async(const K& req) {
+        return m_core.make_request_async(req, [this](const TReq& r) { return prepare_reply(r); }, executor());
+    }
+
+    // `on_reply` is called in this thread on a hit, in an executor thread otherwise
+    template<typename K = TReq>
+    void make_request_async(const K& req, Callback on_reply) {
+        m_core.make_request_async(req, [this](const TReq& r) { return prepare_reply(r); }, executor(), std::move(on_reply));
+    }
+
+    size_t size() const {
+        return m_core.size();
+    }
+
+    size_t weight() const {
+        return m_core.weight();
+    }
+
+    LruStatsSnapshot stats() const {
+        return m_core.stats();
+    }
+
+    using DumpEntry = LruDumpEntry<TReq, TRep>;
+
+    // entries with their recency, see save_snapshot()
+    std::vector<DumpEntry> dump() const {
+        return m_core.dump();
+    }
+
+    void restore(const std::vector<DumpEntry>& entries) {
+        m_core.restore(entries);
+    }
+
+protected:
+    virtual TRep prepare_reply(const TReq& req) const;
+
+private:
+    const LruAsync m_async;
+    std::once_flag m_executor_once;
+    // generates replies for asynchronous requests, started on the first one
+    std::unique_ptr<Executor> m_executor;
+
+    const std::shared_ptr<LruTier<TReq, TRep>> m_tier;
+
+    // sweeps expired entries and runs stale-while-revalidate refreshes, only with TTL
+    std::unique_ptr<BackgroundWorker> m_background;
+
+    LruCacheCore<TReq, TRep, Weigher, Admission, Storage> m_core;
+
+    Executor& executor() {
+        std::call_once(m_executor_once, [this]() { m_executor = std::make_unique<Executor>(m_async.threads, m_async.queue_size); });
+        return *m_executor;
+    }
+};
@@ -1,38 +1,474 @@
 #include "lru.h"
-#include <experimental/random>
+#include "sharded_lru.h"
+#include "clock_cache.h"
+#include "tiny_lfu.h"
+#include "flat_storage.h"
+#include "snapshot.h"
+#include "spill.h"
+#include "bench.h"
+#include "alloc_count.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string_view>
 #include <thread>
 #include <vector>
 
 
+// set from the command line before any cache is created
+size_t reply_size = 4096;
+std::chrono::microseconds gen_latency{0};
+
+// replies generated so far, i.e. cache misses
+std::atomic<size_t> generated{0};
+
+// counts the miss and waits for the backend
+void generate() {
+    generated.fetch_add(1, std::memory_order_relaxed);
+
+    if (gen_latency.count() > 0) {
+        // a backend call
+        std::this_thread::sleep_for(gen_latency);
+    }
+}
+
+std::string reply_for(const std::string& req) {
+    generate();
+
+    std::string reply = "Reply for request " + req + ": ";
+    reply.resize(reply_size, '*');
+    return reply;
+}
+
+// Replies viewing memory the backend keeps alive, e.g. a static table:
+// one filler of `reply_size`. Restored from a snapshot they view the
+// mapped file, nothing is copied.
+std::string_view reply_view_for(const std::string& /*req*/) {
+    static const std::string filler(reply_size, '*');
+    generate();
+    return filler;
+}
+
 template<>
 std::string LruCache<std::string, std::string>::prepare_reply(const std::string& req) const {
-    return "Reply for request " + req + ": some data";
+    return reply_for(req);
 }
 
+template<>
+std::string_view LruCache<std::string, std::string_view>::prepare_reply(const std::string& req) const {
+    return reply_view_for(req);
+}
 
-std::string random_request(int max) {
-    int num = std::experimental::randint(1, max);
-    return "req_" + std::to_string(num);
+template<>
+std::string LruCache<std::string, std::string, ByteWeigher>::prepare_reply(const std::string& req) const {
+    return reply_for(req);
 }
 
+template<>
+std::string LruCache<std::string, std::string, UnitWeigher, TinyLfuAdmission>::prepare_reply(const std::string& req) const {
+    return reply_for(req);
+}
 
-int main(int argc, const char** argv) {
+template<>
+std::string LruCache<std::string, std::string, UnitWeigher, AdmitAll, FlatStorage>::prepare_reply(const std::string& req) const {
+    return reply_for(req);
+}
 
-    LruCache<std::string, std::string> lru(10);
+template<>
+std::string ShardedLruCache<std::string, std::string, UnitWeigher, AdmitAll, FlatStorage>::prepare_reply(const std::string& req) const {
+    return reply_for(req);
+}
+
+template<>
+std::string ShardedLruCache<std::string, std::string, UnitWeigher, TinyLfuAdmission>::prepare_reply(const std::string& req) const {
+    return reply_for(req);
+}
+
+template<>
+std::string ShardedLruCache<std::string, std::string>::prepare_reply(const std::string& req) const {
+    return reply_for(req);
+}
+
+template<>
+std::string ClockCache<std::string, std::string>::prepare_reply(const std::string& req) const {
+    return reply_for(req);
+}
+
+
+template<typename Cache, typename Dist>
+void compare(const char* name, const bench::Options& options, const std::vector<std::string>& keys, const Dist& dist, unsigned threads) {
+    if (!options.runs_cache(name)) {
+        return;
+    }
+    Cache cache(options.cache_size);
+
+    generated = 0;
+    auto result = bench::run(
+        [&cache](const std::string& req) { return cache.make_shared_request(req); }, keys, dist, threads, options.ops);
+    bench::print_result(name, result, 1.0 - static_cast<double>(generated) / (threads * options.ops));
+}
+
+// every cache variant on the same workload
+template<typename Dist>
+void compare_all(const bench::Options& options, const std::vector<std::string>& keys, const Dist& dist) {
+    for (auto threads : options.threads) {
+        std::printf("threads: %u\n", threads);
+        bench::print_header();
+        compare<LruCache<std::string, std::string>>("LruCache", options, keys, dist, threads);
+        compare<LruCache<std::string, std::string, UnitWeigher, TinyLfuAdmission>>("LruCache (TinyLFU)", options, keys, dist, threads);
+        compare<LruCache<std::string, std::string, UnitWeigher, AdmitAll, FlatStorage>>("LruCache (flat)", options, keys, dist, threads);
+        compare<ShardedLruCache<std::string, std::string>>("ShardedLruCache", options, keys, dist, threads);
+        compare<ShardedLruCache<std::string, std::string, UnitWeigher, AdmitAll, FlatStorage>>("ShardedLruCache (flat)", options, keys, dist, threads);
+        compare<ShardedLruCache<std::string, std::string, UnitWeigher, TinyLfuAdmission>>("ShardedLruCache (TinyLFU)", options, keys, dist, threads);
+        // not comparable directly: every concurrent miss generates the reply
+        compare<ClockCache<std::string, std::string>>("ClockCache (no coalescing)", options, keys, dist, threads);
+    }
+}
+
+
+void print_stats(const char* name, const LruStatsSnapshot& stats) {
+    std::printf("%-28s hits %zu, stale %zu, misses %zu, coalesced %zu, evictions %zu, rejections %zu\n", name,
+                size_t(stats.hits), size_t(stats.stale_hits), size_t(stats.misses), size_t(stats.coalesced),
+                size_t(stats.evictions), size_t(stats.rejections));
+    std::printf("%-28s lock wait p50 %lld ns, p99 %lld ns; generation p50 %lld ns, p99 %lld ns\n", "",
+                static_cast<long long>(stats.lock_wait.percentile(0.5).count()), static_cast<long long>(stats.lock_wait.percentile(0.99).count()),
+                static_cast<long long>(stats.generation.percentile(0.5).count()), static_cast<long long>(stats.generation.percentile(0.99).count()));
+}
+
+template<typename Cache, typename Dist>
+void stats_of(const char* name, const bench::Options& options, const std::vector<std::string>& keys, const Dist& dist, unsigned threads) {
+    if (!options.runs_cache(name)) {
+        return;
+    }
+    Cache cache(options.cache_size);
+    bench::run([&cache](const std::string& req) { return cache.make_shared_request(req); }, keys, dist, threads, options.ops);
+    print_stats(name, cache.stats());
+}
+
+
+// Replies expiring many times during the run. With a TTL only, an expired
+// reply is a miss; with a stale period it is still returned while a single
+// background refresh generates the new one.
+template<typename Make, typename Dist>
+void ttl_expiry(const char* name, const Make& make_cache, const bench::Options& options, const std::vector<std::string>& keys, const Dist& dist, unsigned threads) {
+    if (!options.runs_cache(name)) {
+        return;
+    }
+    auto cache = make_cache();
+    auto result = bench::run([&cache](const std::string& req) { return cache->make_shared_request(req); }, keys, dist, threads, options.ops);
+
+    auto stats = cache->stats();
+    bench::print_result(name, result, static_cast<double>(stats.hits + stats.stale_hits) / (threads * options.ops));
+    std::printf("%-28s stale hits %zu, misses %zu, expirations %zu\n", "",
+                size_t(stats.stale_hits), size_t(stats.misses), size_t(stats.expirations));
+}
+
+
+// Misses generated by the executor of the cache: the caller waits for the
+// future, or only issues requests whose callbacks run in executor threads
+// (latency is of the call then, the run ends when all callbacks are done).
+template<typename Make, typename Dist>
+void async_requests(const char* name, const Make& make_cache, const bench::Options& options, const std::vector<std::string>& keys, const Dist& dist, unsigned threads) {
+    using ReplyPtr = typename decltype(make_cache())::element_type::ReplyPtr;
+    using Clock = std::chrono::steady_clock;
+
+    std::string title = std::string(name) + " (future)";
+    if (options.runs_cache(title.c_str())) {
+        auto cache = make_cache();
+        generated = 0;
+        auto result = bench::run([&cache](const std::string& req) { return cache->make_request_async(req).get(); }, keys, dist, threads, options.ops);
+        bench::print_result(title.c_str(), result, 1.0 - static_cast<double>(generated) / (threads * options.ops));
+    }
+
+    title = std::string(name) + " (callback)";
+    if (options.runs_cache(title.c_str())) {
+        auto cache = make_cache();
+        std::atomic<size_t> done{0};
+        generated = 0;
+        auto result = bench::run([&cache, &done](const std::string& req) {
+            cache->make_request_async(req, [&done](ReplyPtr /*reply*/, std::exception_ptr /*error*/) {
+                done.fetch_add(1, std::memory_order_relaxed);
+            });
+        }, keys, dist, threads, options.ops);
+
+        auto start = Clock::now();
+        while (done < threads * options.ops && Clock::now() - start < std::chrono::seconds(10)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        bench::print_result(title.c_str(), result, 1.0 - static_cast<double>(generated) / (threads * options.ops));
+        std::printf("%-28s %zu of %zu callbacks called %.2f ms after the last request\n", "", size_t(done), threads * options.ops,
+                    std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+    }
+}
+
+
+// Hit ratio of a fresh cache over the first `ops` requests: cold and
+// loaded from the snapshot of a cache that served the same workload.
+template<typename Cache, typename Dist>
+void warm_start(const char* name, const bench::Options& options, const std::vector<std::string>& keys, const Dist& dist, unsigned threads) {
+    if (!options.runs_cache(name)) {
+        return;
+    }
+    const std::string path = "lru_snapshot.bin";
+    using Clock = std::chrono::steady_clock;
 
-    std::vector<std::thread> threads;
-    for (int i = 0; i < 10; ++i) {
-        threads.emplace_back([&lru]() {
-            for (int j = 0; j < 100; ++j) {
-                //std::cout << lru.make_request(random_request(3)) << std::endl;
-                lru.make_request(random_request(20));
-            }
-        });
+    auto request = [](Cache& cache) {
+        return [&cache](const std::string& req) { return cache.make_shared_request(req); };
     };
 
-    for (auto& t : threads) {
-        t.join();
+    Cache served(options.cache_size);
+    bench::run(request(served), keys, dist, threads, options.ops);
+
+    auto start = Clock::now();
+    if (!save_snapshot(served, path)) {
+        std::printf("%-28s can not write %s\n", name, path.c_str());
+        return;
+    }
+    auto saved = Clock::now();
+
+    Cache warm(options.cache_size);
+    auto loaded = load_snapshot(warm, path);
+    auto end = Clock::now();
+
+    // restored into a cache half full of other requests: those stay,
+    // restored entries over the capacity are evicted
+    Cache busy(options.cache_size);
+    std::vector<std::string> live;
+    for (size_t i = 0; i < options.cache_size / 2; ++i) {
+        live.push_back("live request " + std::to_string(i));
+        busy.make_shared_request(live.back());
+    }
+    load_snapshot(busy, path);
+    std::remove(path.c_str());
+    generated = 0;
+    for (auto& req : live) {
+        busy.make_shared_request(req);
+    }
+    size_t live_lost = generated;
+
+    Cache cold(options.cache_size);
+    size_t ops = std::min(options.ops, options.cache_size);
+
+    generated = 0;
+    bench::run(request(cold), keys, dist, threads, ops);
+    double cold_hit_ratio = 1.0 - static_cast<double>(generated) / (threads * ops);
+
+    generated = 0;
+    bench::run(request(warm), keys, dist, threads, ops);
+    double warm_hit_ratio = 1.0 - static_cast<double>(generated) / (threads * ops);
+
+    std::printf("%-28s %zu entries, save %.2f ms, load %.2f ms, hit ratio of first %zu requests: cold %.2f%%, warm %.2f%%\n",
+                name, loaded.value_or(0),
+                std::chrono::duration<double, std::milli>(saved - start).count(), std::chrono::duration<double, std::milli>(end - saved).count(),
+                threads * ops, cold_hit_ratio * 100, warm_hit_ratio * 100);
+    std::printf("%-28s restored into a half full cache: %zu of %zu cached requests evicted%s\n",
+                "", live_lost, live.size(), live_lost ? " - FAILED" : "");
+}
+
+
+// The same keys requested one by one and in batches.
+template<typename Cache, typename Dist>
+void batch_vs_loop(const char* name, const bench::Options& options, const std::vector<std::string>& keys, const Dist& dist, unsigned threads, size_t batch) {
+    if (!options.runs_cache(name)) {
+        return;
+    }
+    Cache cache(options.cache_size);
+
+    auto loop = [&cache](const std::vector<std::string_view>& reqs) {
+        for (auto req : reqs) {
+            cache.make_shared_request(req);
+        }
+    };
+    auto batched = [&cache](const std::vector<std::string_view>& reqs) { cache.make_shared_requests(reqs); };
+    auto parallel = [&cache](const std::vector<std::string_view>& reqs) { cache.make_shared_requests(reqs, true); };
+
+    std::string title = std::string(name) + " (loop)";
+    bench::print_result(title.c_str(), bench::run_batches(loop, keys, dist, threads, options.ops, batch));
+    title = std::string(name) + " (batch)";
+    bench::print_result(title.c_str(), bench::run_batches(batched, keys, dist, threads, options.ops, batch));
+    title = std::string(name) + " (parallel)";
+    bench::print_result(title.c_str(), bench::run_batches(parallel, keys, dist, threads, options.ops, batch));
+}
+
+
+// Memory for a tenth of the cache only, with and without the disk tier
+// for the rest.
+template<typename Dist>
+void two_tier(const bench::Options& options, const std::vector<std::string>& keys, const Dist& dist, unsigned threads) {
+    using Cache = LruCache<std::string, std::string>;
+    size_t memory_size = std::max<size_t>(1, options.cache_size / 10);
+    size_t ops = std::min<size_t>(options.ops, 20000);
+
+    auto request = [](Cache& cache) {
+        return [&cache](const std::string& req) { return cache.make_shared_request(req); };
+    };
+
+    if (options.runs_cache("LruCache (memory)")) {
+        Cache cache(memory_size);
+        generated = 0;
+        auto result = bench::run(request(cache), keys, dist, threads, ops);
+        bench::print_result("LruCache (memory)", result, 1.0 - static_cast<double>(generated) / (threads * ops));
+    }
+    if (options.runs_cache("LruCache (memory + disk)")) {
+        auto tier = std::make_shared<SpillTier<std::string, std::string>>(".", options.cache_size * (reply_size + 64));
+        Cache cache(memory_size, {}, {}, {}, {}, tier);
+        generated = 0;
+        auto result = bench::run(request(cache), keys, dist, threads, ops);
+        bench::print_result("LruCache (memory + disk)", result, 1.0 - static_cast<double>(generated) / (threads * ops));
+        std::printf("%-28s %zu replies read back, %zu on disk (%zu bytes)\n", "",
+                    size_t(cache.stats().tier_hits), tier->size(), tier->disk_bytes());
+    }
+}
+
+
+// Hits with requests given as std::string_view slices of a network buffer:
+// looked up directly or converted to std::string first.
+template<typename Cache>
+void allocations_per_hit(const char* name, size_t keys_count) {
+    std::string buffer;
+    std::vector<std::string_view> requests;
+    {
+        std::vector<size_t> offsets;
+        for (size_t i = 0; i < keys_count; ++i) {
+            offsets.push_back(buffer.size());
+            // longer than std::string small buffer
+            buffer += "/api/v1/devices/info?id=" + std::to_string(i);
+        }
+        offsets.push_back(buffer.size());
+        for (size_t i = 0; i < keys_count; ++i) {
+            requests.emplace_back(buffer.data() + offsets[i], offsets[i + 1] - offsets[i]);
+        }
+    }
+
+    // some room for uneven split between shards
+    Cache cache(keys_count * 2);
+    for (auto req : requests) {
+        cache.make_shared_request(req);
     }
 
+    size_t before = thread_allocations();
+    for (auto req : requests) {
+        cache.make_shared_request(std::string(req));
+    }
+    size_t by_string = thread_allocations() - before;
+
+    before = thread_allocations();
+    for (auto req : requests) {
+        cache.make_shared_request(req);
+    }
+    size_t by_view = thread_allocations() - before;
+
+    std::printf("%-28s %6.2f by std::string, %6.2f by std::string_view\n", name,
+                static_cast<double>(by_string) / keys_count, static_cast<double>(by_view) / keys_count);
+}
+
+
+int main(int argc, const char** argv) {
+    const size_t ALLOCATION_KEYS = 1200;
+    const size_t BYTE_BUDGET = 2 * 1024 * 1024;
+    const size_t BATCH = 50;
+    // short against a run: replies expire many times
+    const LruTtl TTL(std::chrono::milliseconds(20), std::chrono::milliseconds(0), std::chrono::milliseconds(10));
+    const LruTtl TTL_STALE(std::chrono::milliseconds(20), std::chrono::milliseconds(200), std::chrono::milliseconds(10));
+    const LruAsync ASYNC(4);
+
+    bench::Options options;
+    if (!bench::parse_options(argc, argv, options)) {
+        return 1;
+    }
+    reply_size = options.reply_size;
+    gen_latency = options.gen_latency;
+
+    std::printf("cache size: %zu, reply size: %zu, generation latency: %lld us, ops per thread: %zu\n",
+                options.cache_size, reply_size, static_cast<long long>(gen_latency.count()), options.ops);
+
+    if (options.runs("uniform")) {
+        auto keys = bench::make_keys(options.uniform_keys);
+
+        std::printf("\nuniform over %zu keys\n", options.uniform_keys);
+        compare_all(options, keys, bench::uniform(options.uniform_keys));
+
+        if (options.runs_cache("LruCache (copy)")) {
+            // reply copied to the caller instead of shared
+            LruCache<std::string, std::string> lru(options.cache_size);
+            bench::print_result("LruCache (copy)", bench::run(
+                [&lru](const std::string& req) { return lru.make_request(req); }, keys, bench::uniform(options.uniform_keys), options.threads.back(), options.ops));
+        }
+    }
+    if (options.runs("zipf")) {
+        auto keys = bench::make_keys(options.keys);
+
+        std::printf("\nzipf(%.2f) over %zu keys\n", options.zipf_s, options.keys);
+        compare_all(options, keys, bench::ZipfDistribution(options.keys, options.zipf_s));
+
+        std::printf("\nstatistics, %u threads\n", options.threads.back());
+        stats_of<LruCache<std::string, std::string>>("LruCache", options, keys, bench::ZipfDistribution(options.keys, options.zipf_s), options.threads.back());
+        stats_of<ShardedLruCache<std::string, std::string>>("ShardedLruCache", options, keys, bench::ZipfDistribution(options.keys, options.zipf_s), options.threads.back());
+
+        std::printf("\nTTL %lld ms, stale %lld ms, %u threads\n", static_cast<long long>(TTL.ttl.count()), static_cast<long long>(TTL_STALE.stale.count()), options.threads.back());
+        bench::print_header();
+        ttl_expiry("LruCache (ttl)", [&options, TTL]() {
+            return std::make_unique<LruCache<std::string, std::string>>(options.cache_size, UnitWeigher(), AdmitAll(), TTL);
+        }, options, keys, bench::ZipfDistribution(options.keys, options.zipf_s), options.threads.back());
+        ttl_expiry("LruCache (ttl + stale)", [&options, TTL_STALE]() {
+            return std::make_unique<LruCache<std::string, std::string>>(options.cache_size, UnitWeigher(), AdmitAll(), TTL_STALE);
+        }, options, keys, bench::ZipfDistribution(options.keys, options.zipf_s), options.threads.back());
+        ttl_expiry("ShardedLruCache (ttl + stale)", [&options, TTL_STALE]() {
+            using Cache = ShardedLruCache<std::string, std::string>;
+            return std::make_unique<Cache>(options.cache_size, Cache::DEFAULT_SHARDS, UnitWeigher(), AdmitAll(), TTL_STALE);
+        }, options, keys, bench::ZipfDistribution(options.keys, options.zipf_s), options.threads.back());
+
+        std::printf("\nasynchronous requests, %zu executor threads, %u threads\n", ASYNC.threads, options.threads.back());
+        bench::print_header();
+        async_requests("LruCache", [&options, ASYNC]() {
+            return std::make_unique<LruCache<std::string, std::string>>(options.cache_size, UnitWeigher(), AdmitAll(), LruTtl(), ASYNC);
+        }, options, keys, bench::ZipfDistribution(options.keys, options.zipf_s), options.threads.back());
+        async_requests("ShardedLruCache", [&options, ASYNC]() {
+            using Cache = ShardedLruCache<std::string, std::string>;
+            return std::make_unique<Cache>(options.cache_size, Cache::DEFAULT_SHARDS, UnitWeigher(), AdmitAll(), LruTtl(), ASYNC);
+        }, options, keys, bench::ZipfDistribution(options.keys, options.zipf_s), options.threads.back());
+
+        std::printf("\nbatches of %zu keys, %u threads\n", BATCH, options.threads.back());
+        bench::print_header();
+        batch_vs_loop<LruCache<std::string, std::string>>("LruCache", options, keys, bench::ZipfDistribution(options.keys, options.zipf_s), options.threads.back(), BATCH);
+        batch_vs_loop<ShardedLruCache<std::string, std::string>>("ShardedLruCache", options, keys, bench::ZipfDistribution(options.keys, options.zipf_s), options.threads.back(), BATCH);
+
+        std::printf("\n%zu entries in memory, %zu on disk, %u threads\n", std::max<size_t>(1, options.cache_size / 10), options.cache_size, options.threads.back());
+        bench::print_header();
+        two_tier(options, keys, bench::ZipfDistribution(options.keys, options.zipf_s), options.threads.back());
+
+        std::printf("\nwarm start, %u threads\n", options.threads.back());
+        warm_start<LruCache<std::string, std::string>>("LruCache", options, keys, bench::ZipfDistribution(options.keys, options.zipf_s), options.threads.back());
+        warm_start<ShardedLruCache<std::string, std::string>>("ShardedLruCache", options, keys, bench::ZipfDistribution(options.keys, options.zipf_s), options.threads.back());
+        // replies restored as views into the mapped snapshot
+        warm_start<LruCache<std::string, std::string_view>>("LruCache (view replies)", options, keys, bench::ZipfDistribution(options.keys, options.zipf_s), options.threads.back());
+    }
+    if (options.runs("scan")) {
+        auto keys = bench::make_keys(options.keys * 2);
+
+        std::printf("\nzipf(%.2f) over %zu keys, %.0f%% of requests scan %zu other keys\n", options.zipf_s, options.keys, options.scan_share * 100, options.keys);
+        compare_all(options, keys, bench::ScanMixDistribution(options.keys, options.zipf_s, options.keys, options.scan_share));
+    }
+    if (options.runs("uniform") && options.runs_cache("LruCache (bytes)")) {
+        auto keys = bench::make_keys(options.uniform_keys);
+        LruCache<std::string, std::string, ByteWeigher> lru(BYTE_BUDGET);
+
+        std::printf("\nuniform over %zu keys, %zu bytes budget, %u threads\n", options.uniform_keys, BYTE_BUDGET, options.threads.back());
+        bench::print_header();
+        generated = 0;
+        auto result = bench::run(
+            [&lru](const std::string& req) { return lru.make_shared_request(req); }, keys, bench::uniform(options.uniform_keys), options.threads.back(), options.ops);
+        bench::print_result("LruCache (bytes)", result, 1.0 - static_cast<double>(generated) / (options.threads.back() * options.ops));
+        std::printf("entries: %zu, bytes: %zu\n", lru.size(), lru.weight());
+    }
+
+    std::printf("\nallocations per hit\n");
+    allocations_per_hit<LruCache<std::string, std::string>>("LruCache", ALLOCATION_KEYS);
+    allocations_per_hit<LruCache<std::string, std::string, UnitWeigher, TinyLfuAdmission>>("LruCache (TinyLFU)", ALLOCATION_KEYS);
+    allocations_per_hit<LruCache<std::string, std::string, UnitWeigher, AdmitAll, FlatStorage>>("LruCache (flat)", ALLOCATION_KEYS);
+    allocations_per_hit<ShardedLruCache<std::string, std::string>>("ShardedLruCache", ALLOCATION_KEYS);
+
     return 0;
-}
\ No newline at end of file
+}
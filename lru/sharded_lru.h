@@ -0,0 +1,226 @@
+#pragma once
+
+#include "lru.h"
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+// Same contract as LruCache, but the key space is split by hash between
+// independent shards (own map, recency queue and mutex each), so threads
+// working with different keys do not contend on a single lock.
+// Recency, weight budget and admission state are per shard,
+// one background worker serves TTL of all shards.
+template<typename TReq, typename TRep, typename Weigher = UnitWeigher, typename Admission = AdmitAll,
+         template<typename, typename> class Storage = MapStorage, typename Hash = LruHash>
+class ShardedLruCache {
+
+public:
+    using ReplyPtr = typename LruCacheCore<TReq, TRep, Weigher, Admission, Storage>::ReplyPtr;
+    using Callback = typename LruCacheCore<TReq, TRep, Weigher, Admission, Storage>::Callback;
+
+    static constexpr size_t DEFAULT_SHARDS = 16;
+
+    ShardedLruCache(size_t size, size_t shards = DEFAULT_SHARDS, const Weigher& weigher = Weigher(), const Admission& admission = Admission(),
+                    LruTtl ttl = LruTtl(), LruAsync async = LruAsync(), std::shared_ptr<LruTier<TReq, TRep>> tier = nullptr) :
+        m_async(async),
+        m_tier(std::move(tier))
+    {
+        if (ttl.enabled()) {
+            m_background = std::make_unique<BackgroundWorker>(ttl.sweep_period, [this]() {
+                for (auto& shard : m_shards) {
+                    shard->sweep();
+                }
+            });
+        }
+
+        // every shard should be able to hold at least one item
+        shards = std::max<size_t>(1, std::min(shards, size));
+
+        m_shards.reserve(shards);
+        for (size_t i = 0; i < shards; ++i) {
+            m_shards.emplace_back(std::make_unique<Shard>(size / shards + (i < size % shards ? 1 : 0), weigher, admission, ttl, m_background.get(), m_tier.get()));
+        }
+
+        if (m_background) {
+            m_background->start();
+        }
+    }
+
+    virtual ~ShardedLruCache() {
+        // asynchronous generations and background refreshes use prepare_reply,
+        // generations still queued are completed
+        m_executor.reset();
+        if (m_background) {
+            m_background->stop();
+        }
+    }
+
+    ShardedLruCache(const ShardedLruCache&) = delete;
+    ShardedLruCache(ShardedLruCache&&) = delete;
+    ShardedLruCache& operator=(ShardedLruCache&) = delete;
+    ShardedLruCache& operator=(ShardedLruCache&&) = delete;
+
+    // `req` is TReq or any key lookup_key() accepts, e.g. std::string_view
+    template<typename K = TReq>
+    TRep make_request(const K& req) {
+        return *make_shared_request(req);
+    }
+
+    template<typename K = TReq>
+    ReplyPtr make_shared_request(const K& req) {
+        return shard_for(lookup_key<TReq>(req)).make_request(req, [this](const TReq& r) { return prepare_reply(r); });
+    }
+
+    // replies in order of `reqs`, a random access container of TReq or
+    // lookup keys; see make_shared_requests()
+    template<typename Keys>
+    std::vector<TRep> make_requests(const Keys& reqs, bool parallel = false) {
+        std::vector<TRep> ret;
+        ret.reserve(reqs.size());
+        for (auto& reply : make_shared_requests(reqs, parallel)) {
+            ret.push_back(*reply);
+        }
+        return ret;
+    }
+
+    // keys are grouped by shard, each shard is locked once for all its hits;
+    // misses of all shards are generated by this thread (with `parallel` -
+    // by the executor and this thread); the first error is rethrown after
+    // all misses are done
+    template<typename Keys>
+    std::vector<ReplyPtr> make_shared_requests(const Keys& reqs, bool parallel = false) {
+        auto gen = [this](const TReq& r) { return prepare_reply(r); };
+
+        std::vector<std::vector<size_t>> by_shard(m_shards.size());
+        for (size_t i = 0; i < reqs.size(); ++i) {
+            by_shard[shard_index(lookup_key<TReq>(reqs[i]))].push_back(i);
+        }
+
+        std::vector<ReplyPtr> ret(reqs.size());
+        std::vector<std::vector<typename Shard::BatchMiss>> misses(m_shards.size());
+        size_t misses_count = 0;
+        for (size_t s = 0; s < m_shards.size(); ++s) {
+            if (!by_shard[s].empty()) {
+                misses[s] = m_shards[s]->lookup_batch(reqs, by_shard[s], ret, gen);
+                misses_count += misses[s].size();
+            }
+        }
+
+        Executor* executor = parallel && misses_count > 1 ? &this->executor() : nullptr;
+        for (size_t s = 0; s < m_shards.size(); ++s) {
+            m_shards[s]->generate_batch(misses[s], gen, executor);
+        }
+        for (size_t s = 0; s < m_shards.size(); ++s) {
+            Shard::wait_batch(misses[s], ret);
+        }
+        return ret;
+    }
+
+    // a hit returns a ready future, a miss is generated by the executor shared by all shards
+    template<typename K = TReq>
+    std::shared_future<ReplyPtr> make_request_async(const K& req) {
+        return shard_for(lookup_key<TReq>(req)).make_request_async(req, [this](const TReq& r) { return prepare_reply(r); }, executor());
+    }
+
+    // `on_reply` is called in this thread on a hit, in an executor thread otherwise
+    template<typename K = TReq>
+    void make_request_async(const K& req, Callback on_reply) {
+        shard_for(lookup_key<TReq>(req)).make_request_async(req, [this](const TReq& r) { return prepare_reply(r); }, executor(), std::move(on_reply));
+    }
+
+    size_t size() const {
+        size_t ret = 0;
+        for (auto& shard : m_shards) {
+            ret += shard->size();
+        }
+        return ret;
+    }
+
+    size_t weight() const {
+        size_t ret = 0;
+        for (auto& shard : m_shards) {
+            ret += shard->weight();
+        }
+        return ret;
+    }
+
+    // sum over shards
+    LruStatsSnapshot stats() const {
+        LruStatsSnapshot ret;
+        for (auto& shard : m_shards) {
+            ret += shard->stats();
+        }
+        return ret;
+    }
+
+    using DumpEntry = LruDumpEntry<TReq, TRep>;
+
+    // entries of all shards, recency order is kept within a shard
+    std::vector<DumpEntry> dump() const {
+        std::vector<DumpEntry> ret;
+        for (auto& shard : m_shards) {
+            auto entries = shard->dump();
+            ret.insert(ret.end(), std::make_move_iterator(entries.begin()), std::make_move_iterator(entries.end()));
+        }
+        return ret;
+    }
+
+    // entries go to their shards, which may differ from the dumped ones
+    void restore(const std::vector<DumpEntry>& entries) {
+        std::vector<std::vector<DumpEntry>> by_shard(m_shards.size());
+        for (auto& entry : entries) {
+            by_shard[shard_index(lookup_key<TReq>(entry.req))].push_back(entry);
+        }
+        for (size_t i = 0; i < m_shards.size(); ++i) {
+            m_shards[i]->restore(by_shard[i]);
+        }
+    }
+
+    size_t shards_count() const {
+        return m_shards.size();
+    }
+
+protected:
+    virtual TRep prepare_reply(const TReq& req) const;
+
+private:
+    // keep shard mutexes on different cache lines
+    struct alignas(64) Shard : LruCacheCore<TReq, TRep, Weigher, Admission, Storage> {
+        using LruCacheCore<TReq, TRep, Weigher, Admission, Storage>::LruCacheCore;
+    };
+
+    const LruAsync m_async;
+    std::once_flag m_executor_once;
+    // generates replies for asynchronous requests, started on the first one
+    std::unique_ptr<Executor> m_executor;
+
+    // one for all shards
+    const std::shared_ptr<LruTier<TReq, TRep>> m_tier;
+
+    // sweeps expired entries and runs stale-while-revalidate refreshes, only with TTL
+    std::unique_ptr<BackgroundWorker> m_background;
+
+    std::vector<std::unique_ptr<Shard>> m_shards;
+    Hash m_hash;
+
+    Executor& executor() {
+        std::call_once(m_executor_once, [this]() { m_executor = std::make_unique<Executor>(m_async.threads, m_async.queue_size); });
+        return *m_executor;
+    }
+
+    // Hash has to accept lookup keys
+    template<typename K>
+    size_t shard_index(const K& req) const {
+        return m_hash(req) % m_shards.size();
+    }
+
+    template<typename K>
+    Shard& shard_for(const K& req) {
+        return *m_shards[shard_index(req)];
+    }
+};
@@ -0,0 +1,290 @@
+#pragma once
+
+#include "lru.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// Warm start of a cache: save_snapshot() writes the cached entries with
+// their recency to a file, load_snapshot() maps the file and puts the
+// entries back, so a restarted process begins with its hot set.
+//
+// File layout (native byte order, the file is for the same host):
+//   header: magic "LRUSNAP", version (uint8), entries count (uint64)
+//   entry:  key size (uint32), reply size (uint32), expiry (int64 ms of
+//           system clock, INT64_MAX - never), queue (uint8), key, reply
+// Entries go in dump() order, the most recent first.
+//
+// Requests and replies are (de)serialized by LruCodec. Requests are always
+// copied out of the file, replies may keep referencing the mapping: then
+// the mapping lives as long as any of them.
+
+
+// Read only mapping of a whole file.
+class MappedFile {
+
+public:
+    // nullptr if the file can not be opened or mapped
+    static std::shared_ptr<const MappedFile> open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return nullptr;
+        }
+
+        struct stat st;
+        void* data = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        // the mapping does not need the descriptor
+        close(fd);
+
+        if (data == MAP_FAILED) {
+            return nullptr;
+        }
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        return std::shared_ptr<const MappedFile>(new MappedFile(data, st.st_size));
+    }
+
+    ~MappedFile() {
+        munmap(m_data, m_size);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile(MappedFile&&) = delete;
+    MappedFile& operator=(MappedFile&) = delete;
+    MappedFile& operator=(MappedFile&&) = delete;
+
+    std::string_view data() const {
+        return std::string_view(static_cast<const char*>(m_data), m_size);
+    }
+
+private:
+    MappedFile(void* data, size_t size) : m_data(data), m_size(size) {}
+
+    void* const m_data;
+    const size_t m_size;
+};
+
+
+// How requests and replies are stored in a snapshot.
+// encode() gives bytes of a value, decode() makes a reply of bytes lying
+// in `mapping`, decode_owned() makes a value owning its bytes (a request,
+// a reply read back by SpillTier).
+template<typename T>
+struct LruCodec;
+
+template<>
+struct LruCodec<std::string> {
+    static std::string_view encode(const std::string& value) {
+        return value;
+    }
+
+    // std::string owns its buffer, the bytes are copied
+    static std::shared_ptr<const std::string> decode(std::string_view bytes, const std::shared_ptr<const MappedFile>& /*mapping*/) {
+        return std::make_shared<const std::string>(bytes);
+    }
+
+    static std::string decode_owned(std::string_view bytes) {
+        return std::string(bytes);
+    }
+};
+
+// Replies are views into the mapping, nothing is copied.
+// No decode_owned(): a view can not own bytes.
+template<>
+struct LruCodec<std::string_view> {
+    static std::string_view encode(std::string_view value) {
+        return value;
+    }
+
+    static std::shared_ptr<const std::string_view> decode(std::string_view bytes, const std::shared_ptr<const MappedFile>& mapping) {
+        struct Holder {
+            std::shared_ptr<const MappedFile> mapping;
+            std::string_view view;
+        };
+        auto holder = std::make_shared<const Holder>(Holder{mapping, bytes});
+        // shares ownership of the holder, points to its view
+        return std::shared_ptr<const std::string_view>(holder, &holder->view);
+    }
+};
+
+
+namespace lru_snapshot {
+
+constexpr char MAGIC[7] = {'L', 'R', 'U', 'S', 'N', 'A', 'P'};
+constexpr uint8_t VERSION = 1;
+constexpr int64_t NEVER = std::numeric_limits<int64_t>::max();
+
+constexpr size_t HEADER_SIZE = sizeof(MAGIC) + sizeof(uint8_t) + sizeof(uint64_t);
+constexpr size_t ENTRY_HEADER_SIZE = 2 * sizeof(uint32_t) + sizeof(int64_t) + sizeof(uint8_t);
+
+// steady clock does not survive restarts, expiry is saved in system clock
+inline int64_t to_file_time(std::chrono::steady_clock::time_point expires) {
+    if (expires == std::chrono::steady_clock::time_point::max()) {
+        return NEVER;
+    }
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(expires - std::chrono::steady_clock::now());
+    auto at = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()) + left;
+    return at.count();
+}
+
+inline std::chrono::steady_clock::time_point from_file_time(int64_t expires) {
+    if (expires == NEVER) {
+        return std::chrono::steady_clock::time_point::max();
+    }
+    auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+    return std::chrono::steady_clock::now() + (std::chrono::milliseconds(expires) - now);
+}
+
+// flushes a written file to the disk, false on error
+inline bool sync_file(const std::string& path, int flags = O_RDONLY) {
+    int fd = ::open(path.c_str(), flags | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+template<typename T>
+void put(std::ofstream& out, T value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// reads a T at `pos` and moves `pos` past it, the bounds are checked by the caller
+template<typename T>
+T get(std::string_view data, size_t& pos) {
+    T value;
+    std::memcpy(&value, data.data() + pos, sizeof(value));
+    pos += sizeof(value);
+    return value;
+}
+
+} // namespace lru_snapshot
+
+
+// Writes all entries of `cache` (LruCache or ShardedLruCache) to `path`.
+// The file is replaced atomically: written aside, synced and renamed, so
+// after a crash `path` is either the old or the new snapshot.
+// Entries with a key or reply over 4 GiB (the size fields) are skipped.
+// Returns false on I/O error.
+template<typename Cache>
+bool save_snapshot(const Cache& cache, const std::string& path) {
+    using namespace lru_snapshot;
+    using Entry = typename Cache::DumpEntry;
+    using ReqCodec = LruCodec<decltype(Entry::req)>;
+    using RepCodec = LruCodec<std::remove_const_t<typename decltype(Entry::reply)::element_type>>;
+
+    auto entries = cache.dump();
+    entries.erase(std::remove_if(entries.begin(), entries.end(), [](const Entry& entry) {
+        return ReqCodec::encode(entry.req).size() > std::numeric_limits<uint32_t>::max() ||
+               RepCodec::encode(*entry.reply).size() > std::numeric_limits<uint32_t>::max();
+    }), entries.end());
+
+    std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+
+        out.write(MAGIC, sizeof(MAGIC));
+        put<uint8_t>(out, VERSION);
+        put<uint64_t>(out, entries.size());
+
+        for (auto& entry : entries) {
+            auto key = ReqCodec::encode(entry.req);
+            auto reply = RepCodec::encode(*entry.reply);
+
+            put<uint32_t>(out, key.size());
+            put<uint32_t>(out, reply.size());
+            put<int64_t>(out, to_file_time(entry.expires));
+            put<uint8_t>(out, entry.queue);
+            out.write(key.data(), key.size());
+            out.write(reply.data(), reply.size());
+        }
+
+        out.close();
+        if (!out || !sync_file(tmp_path)) {
+            std::remove(tmp_path.c_str());
+            return false;
+        }
+    }
+
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    // the rename itself is durable once the directory is synced
+    auto slash = path.rfind('/');
+    sync_file(slash == std::string::npos ? "." : path.substr(0, slash + 1), O_RDONLY | O_DIRECTORY);
+    return true;
+}
+
+// Puts entries saved by save_snapshot() into `cache`, see LruCacheCore::restore().
+// Returns the number of entries in the file, nullopt if the file is missing
+// or damaged (nothing is loaded then).
+template<typename Cache>
+std::optional<size_t> load_snapshot(Cache& cache, const std::string& path) {
+    using namespace lru_snapshot;
+    using Entry = typename Cache::DumpEntry;
+    using ReqCodec = LruCodec<decltype(Entry::req)>;
+    using RepCodec = LruCodec<std::remove_const_t<typename decltype(Entry::reply)::element_type>>;
+
+    auto mapping = MappedFile::open(path);
+    if (!mapping) {
+        return std::nullopt;
+    }
+    auto data = mapping->data();
+
+    if (data.size() < HEADER_SIZE || std::memcmp(data.data(), MAGIC, sizeof(MAGIC)) != 0) {
+        return std::nullopt;
+    }
+    size_t pos = sizeof(MAGIC);
+    if (get<uint8_t>(data, pos) != VERSION) {
+        return std::nullopt;
+    }
+    auto count = get<uint64_t>(data, pos);
+
+    // every entry takes at least its header, a bad count is not trusted
+    std::vector<Entry> entries;
+    entries.reserve(std::min<uint64_t>(count, (data.size() - pos) / ENTRY_HEADER_SIZE));
+
+    for (uint64_t i = 0; i < count; ++i) {
+        if (data.size() - pos < ENTRY_HEADER_SIZE) {
+            return std::nullopt;
+        }
+        auto key_size = get<uint32_t>(data, pos);
+        auto reply_size = get<uint32_t>(data, pos);
+        auto expires = get<int64_t>(data, pos);
+        auto queue = get<uint8_t>(data, pos);
+
+        if (queue > LRU_MAIN || data.size() - pos < uint64_t(key_size) + reply_size) {
+            return std::nullopt;
+        }
+        auto key = data.substr(pos, key_size);
+        auto reply = data.substr(pos + key_size, reply_size);
+        pos += key_size + reply_size;
+
+        entries.push_back(Entry{ReqCodec::decode_owned(key), RepCodec::decode(reply, mapping), from_file_time(expires), static_cast<LruQueue>(queue)});
+    }
+
+    cache.restore(entries);
+    return entries.size();
+}
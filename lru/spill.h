@@ -0,0 +1,425 @@
+#pragma once
+
+#include "lru.h"
+#include "snapshot.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+
+// LruTier on local disk: replies evicted from memory are appended to
+// segment files, an in-memory index maps requests to their records.
+// put() only queues the reply, a background thread writes queued replies
+// in batches; until then get() finds them in the queue. If too many
+// replies wait, new ones are dropped - the tier is a cache too.
+// A reply found by get() goes back to memory and leaves the tier, its record
+// becomes garbage (it is written again when evicted again).
+// The same thread compacts the files: a sealed segment with less than
+// MIN_LIVE_PERCENT of live records has them copied to the active segment
+// and is deleted; over `max_bytes` the oldest segment is dropped whole.
+// The index is not persisted, segment files are deleted by the destructor.
+// Requests and replies are (de)serialized by LruCodec.
+template<typename TReq, typename TRep>
+class SpillTier : public LruTier<TReq, TRep> {
+
+public:
+    using ReplyPtr = std::shared_ptr<const TRep>;
+
+    static constexpr size_t DEFAULT_SEGMENT_SIZE = 64 * 1024 * 1024;
+    static constexpr size_t DEFAULT_MAX_PENDING = 1024;
+    static constexpr std::chrono::milliseconds COMPACT_PERIOD{1000};
+    static constexpr size_t MIN_LIVE_PERCENT = 50;
+
+    // segments are created in `dir`, which has to exist;
+    // `max_bytes` limits all segments together
+    SpillTier(std::string dir, size_t max_bytes, size_t segment_size = DEFAULT_SEGMENT_SIZE, size_t max_pending = DEFAULT_MAX_PENDING) :
+        m_dir(std::move(dir)),
+        m_max_bytes(max_bytes),
+        m_segment_size(std::max<size_t>(1, std::min(segment_size, max_bytes))),
+        m_max_pending(max_pending),
+        m_name("spill-" + std::to_string(getpid()) + "-" + std::to_string(next_instance())),
+        m_worker(COMPACT_PERIOD, [this]() { compact(); })
+    {
+        m_worker.start();
+    }
+
+    ~SpillTier() override {
+        m_worker.stop();
+
+        std::lock_guard guard(m_mtx);
+        for (auto& segment : m_segments) {
+            unlink(segment->path.c_str());
+        }
+    }
+
+    SpillTier(const SpillTier&) = delete;
+    SpillTier(SpillTier&&) = delete;
+    SpillTier& operator=(SpillTier&) = delete;
+    SpillTier& operator=(SpillTier&&) = delete;
+
+    void put(const TReq& req, const ReplyPtr& reply) override {
+        {
+            std::lock_guard guard(m_mtx);
+            if (m_index.find(req) != m_index.end() || m_pending.find(req) != m_pending.end()) {
+                return;
+            }
+            if (m_pending.size() >= m_max_pending) {
+                ++m_dropped;
+                return;
+            }
+            m_pending.emplace(req, reply);
+
+            if (m_flush_posted) {
+                return;
+            }
+            m_flush_posted = true;
+        }
+        m_worker.post([this]() { flush(); });
+    }
+
+    std::optional<TRep> get(const TReq& req) override {
+        Location location;
+        {
+            std::lock_guard guard(m_mtx);
+            if (auto it = m_pending.find(req); it != m_pending.end()) {
+                auto reply = std::move(it->second);
+                m_pending.erase(it);
+                return *reply;
+            }
+            auto it = m_index.find(req);
+            if (it == m_index.end()) {
+                return std::nullopt;
+            }
+            location = std::move(it->second);
+            location.segment->live -= location.size;
+            m_index.erase(it);
+        }
+
+        // the segment stays open while its location is held
+        std::string record(location.size, '\0');
+        if (pread(location.segment->fd, record.data(), record.size(), location.offset) != static_cast<ssize_t>(record.size())) {
+            return std::nullopt;
+        }
+        auto [key, reply] = parse(record);
+        if (key != LruCodec<TReq>::encode(req)) {
+            return std::nullopt;
+        }
+        return LruCodec<TRep>::decode_owned(reply);
+    }
+
+    // stored requests, queued ones included
+    size_t size() const {
+        std::lock_guard guard(m_mtx);
+        return m_index.size() + m_pending.size();
+    }
+
+    // size of all segment files
+    size_t disk_bytes() const {
+        std::lock_guard guard(m_mtx);
+        return m_disk_bytes;
+    }
+
+    // replies not stored because too many were waiting for the writer
+    size_t dropped() const {
+        std::lock_guard guard(m_mtx);
+        return m_dropped;
+    }
+
+private:
+    struct Segment {
+        ~Segment() {
+            close(fd);
+        }
+
+        uint64_t id;
+        std::string path;
+        int fd;
+        // bytes written and bytes of records in the index
+        size_t size;
+        size_t live;
+        // requests of records written here, some may have left the index
+        // or moved since; guarded by m_mtx
+        std::vector<TReq> keys;
+    };
+
+    struct Location {
+        std::shared_ptr<Segment> segment;
+        uint64_t offset;
+        uint32_t size;
+    };
+
+    // record: key size (uint32), reply size (uint32), key, reply
+    static constexpr size_t RECORD_HEADER_SIZE = 2 * sizeof(uint32_t);
+    // index entries compaction handles per lock, put() and get() wait no longer
+    static constexpr size_t INDEX_CHUNK = 256;
+
+    const std::string m_dir;
+    const size_t m_max_bytes;
+    const size_t m_segment_size;
+    const size_t m_max_pending;
+    // prefix of segment file names, unique in `m_dir`
+    const std::string m_name;
+
+    // guarded by m_mtx
+    std::map<TReq, Location, std::less<>> m_index;
+    std::map<TReq, ReplyPtr, std::less<>> m_pending;
+    bool m_flush_posted = false;
+    size_t m_dropped = 0;
+    // from the oldest one, the last is the active segment
+    std::vector<std::shared_ptr<Segment>> m_segments;
+    size_t m_disk_bytes = 0;
+    uint64_t m_next_segment_id = 0;
+
+    mutable std::mutex m_mtx;
+
+    // writes and compacts, the only thread changing segment files
+    BackgroundWorker m_worker;
+
+    static uint64_t next_instance() {
+        static std::atomic<uint64_t> next{0};
+        return next++;
+    }
+
+    static std::pair<std::string_view, std::string_view> parse(std::string_view record) {
+        uint32_t key_size, reply_size;
+        std::memcpy(&key_size, record.data(), sizeof(key_size));
+        std::memcpy(&reply_size, record.data() + sizeof(key_size), sizeof(reply_size));
+        if (record.size() != RECORD_HEADER_SIZE + key_size + reply_size) {
+            return {};
+        }
+        return {record.substr(RECORD_HEADER_SIZE, key_size), record.substr(RECORD_HEADER_SIZE + key_size)};
+    }
+
+    static void append_record(std::string& out, std::string_view key, std::string_view reply) {
+        uint32_t sizes[2] = {static_cast<uint32_t>(key.size()), static_cast<uint32_t>(reply.size())};
+        out.append(reinterpret_cast<const char*>(sizes), sizeof(sizes));
+        out.append(key);
+        out.append(reply);
+    }
+
+    // active segment with room for `bytes`, nullptr if a file can not be created
+    std::shared_ptr<Segment> active_segment(size_t bytes) {
+        // worker thread only
+        {
+            std::lock_guard guard(m_mtx);
+            if (!m_segments.empty() && m_segments.back()->size + bytes <= m_segment_size) {
+                return m_segments.back();
+            }
+        }
+
+        auto segment = std::make_shared<Segment>();
+        segment->id = m_next_segment_id++;
+        segment->path = m_dir + "/" + m_name + "-" + std::to_string(segment->id) + ".seg";
+        segment->fd = ::open(segment->path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        segment->size = 0;
+        segment->live = 0;
+        if (segment->fd < 0) {
+            return nullptr;
+        }
+
+        std::lock_guard guard(m_mtx);
+        m_segments.push_back(segment);
+        return segment;
+    }
+
+    // appends encoded records and returns their locations, empty on I/O error
+    std::vector<Location> write(const std::string& records, const std::vector<uint32_t>& sizes) {
+        // worker thread only
+
+        auto segment = active_segment(records.size());
+        if (!segment) {
+            return {};
+        }
+        if (pwrite(segment->fd, records.data(), records.size(), segment->size) != static_cast<ssize_t>(records.size())) {
+            return {};
+        }
+
+        std::vector<Location> ret;
+        ret.reserve(sizes.size());
+        uint64_t offset = segment->size;
+        for (auto size : sizes) {
+            ret.push_back(Location{segment, offset, size});
+            offset += size;
+        }
+
+        std::lock_guard guard(m_mtx);
+        segment->size += records.size();
+        m_disk_bytes += records.size();
+        return ret;
+    }
+
+    void flush() {
+        std::vector<std::pair<TReq, ReplyPtr>> batch;
+        {
+            std::lock_guard guard(m_mtx);
+            m_flush_posted = false;
+            batch.assign(m_pending.begin(), m_pending.end());
+        }
+
+        // a batch larger than a segment is split
+        size_t begin = 0;
+        while (begin < batch.size()) {
+            std::string records;
+            std::vector<uint32_t> sizes;
+            size_t end = begin;
+            while (end < batch.size() && (end == begin || records.size() < m_segment_size)) {
+                size_t before = records.size();
+                append_record(records, LruCodec<TReq>::encode(batch[end].first), LruCodec<TRep>::encode(*batch[end].second));
+                sizes.push_back(records.size() - before);
+                ++end;
+            }
+
+            auto locations = write(records, sizes);
+
+            std::lock_guard guard(m_mtx);
+            for (size_t i = begin; i < end; ++i) {
+                // not written: dropped
+                m_pending.erase(batch[i].first);
+                if (!locations.empty()) {
+                    auto& location = locations[i - begin];
+                    auto* segment = location.segment.get();
+                    auto size = location.size;
+                    // a record already in the index leaves this one garbage
+                    if (m_index.emplace(batch[i].first, std::move(location)).second) {
+                        segment->live += size;
+                        segment->keys.push_back(std::move(batch[i].first));
+                    }
+                }
+            }
+            begin = end;
+        }
+
+        compact();
+    }
+
+    void compact() {
+        // worker thread only
+
+        while (true) {
+            std::shared_ptr<Segment> victim;
+            bool over_budget = false;
+            bool drop = false;
+            std::vector<TReq> keys;
+            {
+                std::lock_guard guard(m_mtx);
+                over_budget = m_disk_bytes > m_max_bytes;
+
+                // the active segment is never compacted
+                for (size_t i = 0; i + 1 < m_segments.size(); ++i) {
+                    auto& segment = m_segments[i];
+                    if (segment->live * 100 < segment->size * MIN_LIVE_PERCENT &&
+                        (!victim || segment->live * victim->size < victim->live * segment->size)) {
+                        victim = segment;
+                    }
+                }
+                if (!victim && over_budget && m_segments.size() > 1) {
+                    victim = m_segments.front();
+                }
+                // copying live records would not reduce the size below the budget
+                drop = victim && over_budget && victim->live * 100 >= victim->size * MIN_LIVE_PERCENT;
+                if (victim) {
+                    // a sealed segment gets no new records
+                    keys = std::move(victim->keys);
+                }
+            }
+            if (!victim) {
+                return;
+            }
+
+            std::sort(keys.begin(), keys.end());
+            keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+            if (!drop) {
+                move_live_records(*victim, keys);
+            }
+            remove_segment(victim, keys);
+        }
+    }
+
+    // `keys`: requests written to the segment, unique
+    void move_live_records(const Segment& victim, const std::vector<TReq>& keys) {
+        // worker thread only
+
+        std::vector<std::pair<TReq, Location>> live;
+        for (size_t begin = 0; begin < keys.size(); begin += INDEX_CHUNK) {
+            std::lock_guard guard(m_mtx);
+            for (size_t i = begin; i < std::min(keys.size(), begin + INDEX_CHUNK); ++i) {
+                auto it = m_index.find(keys[i]);
+                if (it != m_index.end() && it->second.segment.get() == &victim) {
+                    live.emplace_back(it->first, it->second);
+                }
+            }
+        }
+
+        std::string records;
+        std::vector<uint32_t> sizes;
+        for (auto& [req, location] : live) {
+            size_t before = records.size();
+            records.resize(before + location.size);
+            if (pread(victim.fd, records.data() + before, location.size, location.offset) != static_cast<ssize_t>(location.size)) {
+                records.resize(before);
+                location.segment = nullptr;
+                continue;
+            }
+            sizes.push_back(location.size);
+        }
+
+        auto locations = write(records, sizes);
+        if (locations.empty()) {
+            return;
+        }
+
+        size_t moved = 0;
+        for (size_t begin = 0; begin < live.size(); begin += INDEX_CHUNK) {
+            std::lock_guard guard(m_mtx);
+            for (size_t i = begin; i < std::min(live.size(), begin + INDEX_CHUNK); ++i) {
+                auto& [req, location] = live[i];
+                if (!location.segment) {
+                    continue;
+                }
+                auto it = m_index.find(req);
+                if (it != m_index.end() && it->second.segment.get() == &victim) {
+                    auto& moved_to = locations[moved];
+                    moved_to.segment->live += moved_to.size;
+                    moved_to.segment->keys.push_back(req);
+                    it->second = moved_to;
+                }
+                ++moved;
+            }
+        }
+    }
+
+    // entries left in the segment are dropped; `keys`: requests written to it
+    void remove_segment(const std::shared_ptr<Segment>& victim, const std::vector<TReq>& keys) {
+        // worker thread only, no new entries point to a sealed segment
+        for (size_t begin = 0; begin < keys.size(); begin += INDEX_CHUNK) {
+            std::lock_guard guard(m_mtx);
+            for (size_t i = begin; i < std::min(keys.size(), begin + INDEX_CHUNK); ++i) {
+                auto it = m_index.find(keys[i]);
+                if (it != m_index.end() && it->second.segment == victim) {
+                    m_index.erase(it);
+                }
+            }
+        }
+
+        std::lock_guard guard(m_mtx);
+        m_segments.erase(std::find(m_segments.begin(), m_segments.end(), victim));
+        m_disk_bytes -= victim->size;
+        // readers holding it keep reading the unlinked file
+        unlink(victim->path.c_str());
+    }
+};
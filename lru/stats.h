@@ -0,0 +1,196 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+
+// Histogram of durations with power of two buckets:
+// bucket 0 counts zero durations, bucket i counts [2^(i-1), 2^i) ns,
+// the last one everything longer.
+struct LruHistogram {
+    static constexpr size_t BUCKETS = 32;
+
+    static size_t bucket_of(uint64_t ns) {
+        if (ns == 0) {
+            return 0;
+        }
+        return std::min<size_t>(BUCKETS - 1, 64 - __builtin_clzll(ns));
+    }
+
+    uint64_t count() const {
+        uint64_t ret = 0;
+        for (auto n : buckets) {
+            ret += n;
+        }
+        return ret;
+    }
+
+    // upper bound of the bucket holding quantile `q` (0..1)
+    std::chrono::nanoseconds percentile(double q) const {
+        uint64_t total = count();
+        if (total == 0) {
+            return {};
+        }
+
+        uint64_t rank = static_cast<uint64_t>(q * (total - 1));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            seen += buckets[i];
+            if (seen > rank) {
+                return std::chrono::nanoseconds(i == 0 ? 0 : (uint64_t(1) << i) - 1);
+            }
+        }
+        return std::chrono::nanoseconds((uint64_t(1) << (BUCKETS - 1)) - 1);
+    }
+
+    LruHistogram& operator+=(const LruHistogram& other) {
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            buckets[i] += other.buckets[i];
+        }
+        return *this;
+    }
+
+    uint64_t buckets[BUCKETS] = {};
+};
+
+
+// Counters of a cache at some moment, see LruStats.
+struct LruStatsSnapshot {
+    // fresh replies found in cache
+    uint64_t hits = 0;
+    // replies returned in the stale period
+    uint64_t stale_hits = 0;
+    // replies generated by the requesting thread or its executor
+    uint64_t misses = 0;
+    // requests waiting for a reply generated for another request
+    uint64_t coalesced = 0;
+    // entries removed to fit the capacity
+    uint64_t evictions = 0;
+    // entries dropped by admission policy on leaving the window
+    uint64_t rejections = 0;
+    // entries removed after TTL and stale period
+    uint64_t expirations = 0;
+    // prepare_reply calls ended with exception
+    uint64_t generation_errors = 0;
+    // misses served by the second tier (see LruTier) instead of prepare_reply
+    uint64_t tier_hits = 0;
+
+    // time to take the cache mutex, zero if it was free
+    LruHistogram lock_wait;
+    // prepare_reply (or second tier lookup) duration, background refreshes included
+    LruHistogram generation;
+
+    double hit_ratio() const {
+        uint64_t total = hits + stale_hits + misses + coalesced;
+        return total == 0 ? 0.0 : double(hits + stale_hits) / total;
+    }
+
+    LruStatsSnapshot& operator+=(const LruStatsSnapshot& other) {
+        hits += other.hits;
+        stale_hits += other.stale_hits;
+        misses += other.misses;
+        coalesced += other.coalesced;
+        evictions += other.evictions;
+        rejections += other.rejections;
+        expirations += other.expirations;
+        generation_errors += other.generation_errors;
+        tier_hits += other.tier_hits;
+        lock_wait += other.lock_wait;
+        generation += other.generation;
+        return *this;
+    }
+};
+
+
+// Statistics of LruCacheCore, always on.
+// Counters are split into stripes on separate cache lines and every thread
+// writes to its own stripe with relaxed atomics, so concurrent requests do
+// not bounce a shared line. snapshot() sums the stripes, it does not stop
+// writers: counters of one snapshot are not exactly consistent with each other.
+class LruStats {
+
+public:
+    enum Counter : uint8_t {
+        HITS,
+        STALE_HITS,
+        MISSES,
+        COALESCED,
+        EVICTIONS,
+        REJECTIONS,
+        EXPIRATIONS,
+        GENERATION_ERRORS,
+        TIER_HITS,
+        COUNTERS
+    };
+
+    enum Timing : uint8_t {
+        LOCK_WAIT,
+        GENERATION,
+        TIMINGS
+    };
+
+    LruStats() = default;
+
+    LruStats(const LruStats&) = delete;
+    LruStats(LruStats&&) = delete;
+    LruStats& operator=(LruStats&) = delete;
+    LruStats& operator=(LruStats&&) = delete;
+
+    void add(Counter counter, uint64_t n = 1) {
+        stripe().counters[counter].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    void record(Timing timing, std::chrono::nanoseconds duration) {
+        uint64_t ns = duration.count() > 0 ? duration.count() : 0;
+        stripe().timings[timing][LruHistogram::bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    LruStatsSnapshot snapshot() const {
+        uint64_t counters[COUNTERS] = {};
+        LruStatsSnapshot ret;
+
+        for (auto& s : m_stripes) {
+            for (size_t i = 0; i < COUNTERS; ++i) {
+                counters[i] += s.counters[i].load(std::memory_order_relaxed);
+            }
+            for (size_t i = 0; i < LruHistogram::BUCKETS; ++i) {
+                ret.lock_wait.buckets[i] += s.timings[LOCK_WAIT][i].load(std::memory_order_relaxed);
+                ret.generation.buckets[i] += s.timings[GENERATION][i].load(std::memory_order_relaxed);
+            }
+        }
+
+        ret.hits = counters[HITS];
+        ret.stale_hits = counters[STALE_HITS];
+        ret.misses = counters[MISSES];
+        ret.coalesced = counters[COALESCED];
+        ret.evictions = counters[EVICTIONS];
+        ret.rejections = counters[REJECTIONS];
+        ret.expirations = counters[EXPIRATIONS];
+        ret.generation_errors = counters[GENERATION_ERRORS];
+        ret.tier_hits = counters[TIER_HITS];
+        return ret;
+    }
+
+private:
+    static constexpr size_t STRIPES = 16;
+
+    struct alignas(64) Stripe {
+        std::atomic<uint64_t> counters[COUNTERS] = {};
+        std::atomic<uint64_t> timings[TIMINGS][LruHistogram::BUCKETS] = {};
+    };
+
+    Stripe m_stripes[STRIPES];
+
+    // threads get stripes round robin on their first use of any cache
+    static size_t thread_stripe() {
+        static std::atomic<size_t> next{0};
+        thread_local size_t stripe = next.fetch_add(1, std::memory_order_relaxed) % STRIPES;
+        return stripe;
+    }
+
+    Stripe& stripe() {
+        return m_stripes[thread_stripe()];
+    }
+};
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+
+// W-TinyLFU admission for LruCache: a count-min sketch estimates how often
+// each request was seen recently, and an entry leaving the window LRU
+// replaces the main LRU victim only if it was requested more often.
+// Counters are halved every SAMPLE_FACTOR * counters records, so old
+// popularity fades out. One-off requests of a scan stay in the small window
+// and do not push the hot set out of the cache.
+class TinyLfuAdmission {
+
+public:
+    static constexpr size_t DEFAULT_COUNTERS = 4096;
+    static constexpr size_t WINDOW_PERCENT = 1;
+
+    // `counters` per sketch row, should be about the number of cached entries
+    TinyLfuAdmission(size_t counters = DEFAULT_COUNTERS) {
+        while ((size_t(1) << m_width_bits) < std::max<size_t>(counters, 16)) {
+            ++m_width_bits;
+        }
+        m_sketch.assign(ROWS << m_width_bits, 0);
+        m_sample_size = SAMPLE_FACTOR << m_width_bits;
+    }
+
+    size_t window_size(size_t capacity) const {
+        return std::max<size_t>(1, capacity * WINDOW_PERCENT / 100);
+    }
+
+    // std::hash gives the same value for a request and its lookup key
+    template<typename K>
+    void record(const K& req) {
+        size_t hash = std::hash<K>()(req);
+        for (size_t row = 0; row < ROWS; ++row) {
+            auto& counter = m_sketch[index(hash, row)];
+            if (counter < MAX_COUNTER) {
+                ++counter;
+            }
+        }
+
+        if (++m_additions == m_sample_size) {
+            age();
+        }
+    }
+
+    template<typename TReq>
+    bool admit(const TReq& candidate, const TReq& victim) const {
+        return frequency(std::hash<TReq>()(candidate)) > frequency(std::hash<TReq>()(victim));
+    }
+
+private:
+    static constexpr size_t ROWS = 4;
+    static constexpr size_t SAMPLE_FACTOR = 10;
+    static constexpr uint8_t MAX_COUNTER = 15;
+
+    size_t m_width_bits = 0;
+    std::vector<uint8_t> m_sketch;
+
+    size_t m_sample_size = 0;
+    size_t m_additions = 0;
+
+    size_t index(size_t hash, size_t row) const {
+        static const uint64_t SEEDS[ROWS] = {
+            0x9E3779B97F4A7C15ull, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull, 0xD6E8FEB86659FD93ull
+        };
+        uint64_t h = (static_cast<uint64_t>(hash) + row) * SEEDS[row];
+        return (row << m_width_bits) + (h >> (64 - m_width_bits));
+    }
+
+    uint8_t frequency(size_t hash) const {
+        uint8_t ret = MAX_COUNTER;
+        for (size_t row = 0; row < ROWS; ++row) {
+            ret = std::min(ret, m_sketch[index(hash, row)]);
+        }
+        return ret;
+    }
+
+    void age() {
+        for (auto& counter : m_sketch) {
+            counter /= 2;
+        }
+        m_additions /= 2;
+    }
+};
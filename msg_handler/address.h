@@ -0,0 +1,54 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <cstdint>
+#include <cstring>
+#include <fmt/format.h>
+#include <netinet/in.h>
+#include <string>
+
+
+// Client addresses packed into plain integers: cheap to copy, compare and
+// hash, keys of connection tables. Text is made only for logs. The
+// transport listens on IPv4 only.
+
+// IPv4 address (bits 16..47) and port (bits 0..15)
+using Ipv4Key = uint64_t;
+
+inline Ipv4Key pack(const struct sockaddr_in& addr) {
+	return uint64_t(ntohl(addr.sin_addr.s_addr)) << 16 | ntohs(addr.sin_port);
+}
+
+inline struct sockaddr_in unpack(Ipv4Key key) {
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(static_cast<uint32_t>(key >> 16));
+	addr.sin_port = htons(static_cast<uint16_t>(key));
+	return addr;
+}
+
+inline std::string to_string(Ipv4Key key) {
+	auto addr = unpack(key);
+	char buf[INET_ADDRSTRLEN];
+	return fmt::format("{}:{}", inet_ntop(AF_INET, &addr.sin_addr, buf, sizeof(buf)), ntohs(addr.sin_port));
+}
+
+
+// Addresses of a few clients differ in a few low bits, the table needs
+// them spread over all bits.
+struct AddressHash {
+	static uint64_t mix(uint64_t x) {
+		// murmur3 finalizer
+		x ^= x >> 33;
+		x *= 0xff51afd7ed558ccdULL;
+		x ^= x >> 33;
+		x *= 0xc4ceb9fe1a85ec53ULL;
+		x ^= x >> 33;
+		return x;
+	}
+
+	size_t operator()(Ipv4Key key) const {
+		return mix(key);
+	}
+};
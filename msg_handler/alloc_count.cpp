@@ -0,0 +1,31 @@
+#include "alloc_count.h"
+
+#include <cstdlib>
+#include <new>
+
+
+// a separate translation unit: inlined into callers, free() of memory
+// from operator new looks mismatched to gcc
+namespace {
+thread_local size_t allocations = 0;
+}
+
+size_t thread_allocations() {
+	return allocations;
+}
+
+void* operator new(size_t size) {
+	++allocations;
+	if (void* p = std::malloc(size ? size : 1)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+	std::free(p);
+}
+
+void operator delete(void* p, size_t /*size*/) noexcept {
+	std::free(p);
+}
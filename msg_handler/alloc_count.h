@@ -0,0 +1,8 @@
+#pragma once
+
+#include <cstddef>
+
+
+// Heap allocations made by the calling thread so far. Counted by the
+// operator new replacement in alloc_count.cpp, which only benchmarks link.
+size_t thread_allocations();
@@ -0,0 +1,206 @@
+#include "address.h"
+#include "alloc_count.h"
+#include "flat_map.h"
+#include "protocol.h"
+#include "timer_wheel.h"
+#include "udp_transport.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fmt/format.h>
+#include <map>
+#include <random>
+#include <unistd.h>
+#include <vector>
+
+
+// Receive throughput of UdpTransport: a local socket sends bursts of
+// datagrams, on_data_ready() drains them, only the draining is timed.
+// recv batch 1 makes a syscall per datagram, as recvfrom did.
+
+const static int BURST = 128;
+const static int ROUNDS = 2000;
+
+
+int open_sender() {
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0) {
+		throw std::runtime_error(fmt::format("socket fail: {}", strerror(errno)));
+	}
+	return sock;
+}
+
+void bench_recv(size_t recv_batch) {
+	size_t received = 0;
+	UdpTransport transport([&](std::string_view, Client&&) { ++received; }, false, recv_batch);
+
+	// the whole burst has to fit into the socket buffer
+	int rcvbuf = 4 * 1024 * 1024;
+	setsockopt(transport.get_fd(), SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	int sender = open_sender();
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(listened_port());
+
+	// a PONG-sized message
+	const char payload[] = "\x08\x00";
+
+	std::chrono::nanoseconds spent{0};
+	size_t sent = 0;
+	for (int round = 0; round < ROUNDS; ++round) {
+		for (int i = 0; i < BURST; ++i) {
+			if (sendto(sender, payload, sizeof(payload) - 1, 0, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) > 0) {
+				++sent;
+			}
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		transport.on_data_ready();
+		spent += std::chrono::steady_clock::now() - start;
+	}
+	close(sender);
+
+	double seconds = std::chrono::duration<double>(spent).count();
+	fmt::print("recv batch {:>3}: {:>10.0f} packets/s ({} of {} received)\n", recv_batch, received / seconds, received, sent);
+}
+
+
+// Keepalive timers of `connections` connections over a simulated minute:
+// every connection pings each 10 s and its pong moves the deadline, as
+// Connection does; the time is spent on the wheel only.
+void bench_timers(size_t connections) {
+	const long int PING_MS = 10000;
+	const long int PONG_DELAY_MS = 20;
+	const long int DURATION_MS = 60000;
+
+	long int now = 0;
+	TimerWheel wheel(now);
+	std::vector<TimerWheel::TimerId> ids(connections);
+	size_t fired = 0;
+	for (size_t i = 0; i < connections; ++i) {
+		// spread over the first interval
+		ids[i] = wheel.schedule(i * PING_MS / connections, [&, i]() {
+			++fired;
+			// the pong arrives, the next ping is due an interval later
+			wheel.reschedule(ids[i], now + PONG_DELAY_MS);
+			wheel.reschedule(ids[i], now + PING_MS);
+		});
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	for (; now <= DURATION_MS; now += TimerWheel::TICK_MS) {
+		wheel.advance(now);
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	fmt::print("timers {:>7}: {:>10.0f} deadlines/s, {:.1f} ms per simulated second\n", connections, fired / seconds, seconds * 1000 * 1000 / DURATION_MS);
+}
+
+
+template<typename Parse>
+void bench_parse(const char* name, const std::vector<std::string>& datagrams, Parse&& parse) {
+	const size_t MESSAGES = 1000000;
+
+	size_t parsed = 0;
+	size_t before = thread_allocations();
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < MESSAGES; ++i) {
+		parsed += parse(datagrams[i % datagrams.size()], i);
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	double allocs = double(thread_allocations() - before) / MESSAGES;
+	fmt::print("  {:<10}: {:>10.0f} messages/s, {:.2f} allocations/message ({} parsed)\n", name, MESSAGES / seconds, allocs, parsed);
+}
+
+// Parsing of received messages: protocol::parseFrom makes a heap message
+// per datagram, protocol::Parser parses into its arena, reset per batch
+// of RECV_BATCH messages as MsgHandler does.
+void bench_parse(const char* title, const std::vector<std::string>& datagrams) {
+	fmt::print("parse {}\n", title);
+
+	bench_parse("parseFrom", datagrams, [](const std::string& data, size_t) {
+		return protocol::parseFrom(data).has_value();
+	});
+
+	protocol::Parser parser;
+	bench_parse("Parser", datagrams, [&](const std::string& data, size_t i) {
+		bool ok = parser.parse(data) != nullptr;
+		if ((i + 1) % UdpTransport::RECV_BATCH == 0) {
+			parser.reset();
+		}
+		return ok;
+	});
+}
+
+
+template<typename Find>
+void bench_lookup(const char* name, const std::vector<sockaddr_in>& peers, Find&& find) {
+	const size_t LOOKUPS = 2000000;
+
+	size_t found = 0;
+	size_t before = thread_allocations();
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < LOOKUPS; ++i) {
+		found += find(peers[i % peers.size()]);
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	double allocs = double(thread_allocations() - before) / LOOKUPS;
+	fmt::print("  {:<10}: {:>10.0f} lookups/s, {:.2f} allocations/lookup ({} found)\n", name, LOOKUPS / seconds, allocs, found);
+}
+
+// Connection lookup per received datagram: a std::map keyed by the
+// "address:port" label formatted for each datagram, as before, against
+// FlatMap keyed by the packed address. Peers are looked up in random order.
+void bench_lookup(size_t connections) {
+	fmt::print("lookup {} connections\n", connections);
+
+	std::mt19937 random(connections);
+	std::vector<sockaddr_in> peers(connections);
+	std::map<std::string, size_t> labels;
+	FlatMap<Ipv4Key, size_t, AddressHash> table;
+	for (size_t i = 0; i < connections; ++i) {
+		peers[i] = unpack(Ipv4Key(0x0a000000 + random() % 0x10000) << 16 | (1024 + i % 60000));
+		labels.try_emplace(to_string(pack(peers[i])), i);
+		table.try_emplace(pack(peers[i]), i);
+	}
+	std::shuffle(peers.begin(), peers.end(), random);
+
+	bench_lookup("std::map", peers, [&](const sockaddr_in& addr) {
+		char buf[INET_ADDRSTRLEN];
+		auto label = fmt::format("{}:{}", inet_ntop(AF_INET, &addr.sin_addr, buf, sizeof(buf)), ntohs(addr.sin_port));
+		return labels.find(label) != labels.end();
+	});
+	bench_lookup("FlatMap", peers, [&](const sockaddr_in& addr) {
+		return table.find(pack(addr)) != nullptr;
+	});
+}
+
+
+int main(int argc, const char** argv) {
+	for (size_t recv_batch : {size_t(1), size_t(8), UdpTransport::RECV_BATCH}) {
+		bench_recv(recv_batch);
+	}
+	for (size_t connections : {size_t(1000), size_t(100000)}) {
+		bench_timers(connections);
+	}
+	for (size_t connections : {size_t(100), size_t(100000)}) {
+		bench_lookup(connections);
+	}
+	// what hosts send
+	bench_parse("requests", {
+		protocol::serialize(pb::PONG),
+		protocol::serialize(pb::PONG),
+		protocol::serialize(pb::CONNECT),
+		protocol::serialize(pb::GET_DEV_INFO),
+	});
+	// Any payload: strings longer than SSO keep their buffers in the heap, arena or not
+	bench_parse("with data", {
+		protocol::serialized_dev_info("device", "Linux 6.1", "0123456789", "bench device"),
+	});
+	return 0;
+}
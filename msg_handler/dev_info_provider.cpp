@@ -0,0 +1,101 @@
+#include "dev_info_provider.h"
+#include "device_info.h"
+#include "logger.h"
+#include "protocol.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <set>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+
+DevInfoProvider::DevInfoProvider(Reactor& reactor_, long int refresh_ms) : reactor(reactor_) {
+	refresh();
+
+	watch_files();
+
+	if (refresh_ms > 0) {
+		refresh_timer = reactor.schedule_every(refresh_ms, [this]() { refresh(); });
+	}
+}
+
+DevInfoProvider::~DevInfoProvider() {
+	if (refresh_timer) {
+		reactor.cancel(refresh_timer);
+	}
+	if (inotify_fd >= 0) {
+		reactor.remove(inotify_fd);
+		close(inotify_fd);
+	}
+}
+
+void DevInfoProvider::watch_files() {
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd < 0) {
+		LOG_WARNING("inotify_init1 fail: {}, device info is refreshed by timer only", strerror(errno));
+		return;
+	}
+
+	// directories, not files: files there are usually replaced by rename;
+	// os-release is often a link to /usr/lib/os-release
+	std::set<std::string> dirs{"/etc"};
+	if (char* path = realpath(device_info::OS_RELEASE_PATH, nullptr)) {
+		dirs.insert(std::filesystem::path(path).parent_path());
+		free(path);
+	}
+	for (auto& dir : dirs) {
+		if (inotify_add_watch(inotify_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE) < 0) {
+			LOG_WARNING("inotify on {} fail: {}", dir, strerror(errno));
+		}
+	}
+	reactor.add(inotify_fd, EPOLLIN, [this](uint32_t) { on_inotify(); });
+}
+
+void DevInfoProvider::refresh() {
+	auto new_frame = protocol::dev_info_frame(device_info::device_name(), device_info::os_version(), device_info::serial_number(), device_info::description());
+	if (!frame.empty() && new_frame.data() != frame.data()) {
+		LOG_INFO("device info changed");
+	}
+	frame = new_frame;
+}
+
+void DevInfoProvider::on_inotify() {
+	bool changed = false;
+
+	alignas(struct inotify_event) char buf[4096];
+	while (true) {
+		auto len = read(inotify_fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN) {
+				LOG_ERROR_LIMITED("inotify read fail: {} ({})", strerror(errno), errno);
+			}
+			break;
+		}
+
+		for (char* ptr = buf; ptr < buf + len; ) {
+			auto* event = reinterpret_cast<struct inotify_event*>(ptr);
+			// events were lost, any of them may have been a change
+			if (event->mask & IN_Q_OVERFLOW) {
+				changed = true;
+			}
+			else if (event->len > 0) {
+				std::string_view name(event->name);
+				changed = changed || name == "os-release" || name == "hostname";
+			}
+			ptr += sizeof(struct inotify_event) + event->len;
+		}
+	}
+
+	// one refresh for a burst of events
+	if (changed) {
+		refresh();
+	}
+}
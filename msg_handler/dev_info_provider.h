@@ -0,0 +1,39 @@
+#pragma once
+
+#include "reactor.h"
+
+#include <string_view>
+
+
+// Serialized DEV_INFO reply, ready to send.
+// Device data is read once and again when it may have changed: inotify
+// reports a change of /etc/os-release or /etc/hostname, or the refresh
+// interval passes (the kernel host name can change without touching files).
+class DevInfoProvider {
+private:
+	Reactor& reactor;
+	int inotify_fd = -1;
+	Reactor::TimerId refresh_timer = 0;
+
+	// protocol::dev_info_frame(), valid for the whole run
+	std::string_view frame;
+
+	void watch_files();
+	void on_inotify();
+
+public:
+	const static long int DEFAULT_REFRESH_MS = 60000;
+
+	// refresh_ms: 0 - on file changes only
+	DevInfoProvider(Reactor& reactor, long int refresh_ms = DEFAULT_REFRESH_MS);
+	~DevInfoProvider();
+	DevInfoProvider(const DevInfoProvider&) = delete;
+	DevInfoProvider& operator=(const DevInfoProvider&) = delete;
+
+	std::string_view reply() const {
+		return frame;
+	}
+
+	// reads device data again
+	void refresh();
+};
@@ -1,31 +1,15 @@
 #include "device_info.h"
+#include "logger.h"
 
 #include <algorithm>
-#include <cstdio>
-#include <fmt/format.h>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iterator>
 #include <string>
+#include <sys/utsname.h>
 
 
-std::string exec(std::string_view cmd) {
-    std::string res;
-
-    std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(cmd.data(), "r"), pclose);
-    std::array<char, 128> buf;
-
-    if (!pipe) {
-		fmt::print("[ERROR] popen fail: {} ({})\n", strerror(errno), errno);
-    }
-    while (fgets(buf.data(), buf.size(), pipe.get()) != nullptr) {
-        res += buf.data();
-    }
-    if (!feof(pipe.get())) {
-		fmt::print("[ERROR] popen read fail: {}\n", ferror(pipe.get()));
-	}
-
-
-    return res;
-}
-
 void rtrim(std::string& s) {
     s.erase(std::find_if(s.rbegin(), s.rend(), [](unsigned char ch) {
         return !std::isspace(ch);
@@ -36,13 +20,21 @@ void rtrim(std::string& s) {
 namespace device_info {
 
 std::string device_name() {
-	auto ret = exec("hostname");
-	rtrim(ret);
-	return ret;
+	struct utsname name;
+	if (uname(&name) < 0) {
+		LOG_ERROR("uname fail: {} ({})", strerror(errno), errno);
+		return {};
+	}
+	return name.nodename;
 }
 
 std::string os_version() {
-	auto ret = exec("cat /etc/os-release");
+	std::ifstream file(OS_RELEASE_PATH);
+	if (!file) {
+		LOG_ERROR("{} read fail", OS_RELEASE_PATH);
+		return {};
+	}
+	std::string ret{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
 	rtrim(ret);
 	return ret;
 }
@@ -4,6 +4,9 @@
 
 
 namespace device_info {
+	const char* const OS_RELEASE_PATH = "/etc/os-release";
+
+	// read directly: uname(), the files
 	std::string device_name();
 	std::string os_version();
 	std::string serial_number();
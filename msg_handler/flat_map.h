@@ -0,0 +1,120 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <optional>
+#include <utility>
+#include <vector>
+
+
+// Hash map with open addressing in one array: a lookup is a hash and a
+// probe of neighbouring slots, with no node allocations and no pointer
+// chasing. Linear probing; erase shifts the following entries back, so
+// there are no tombstones. The load factor is kept at most 1/2.
+// Values have to be move constructible. Pointers returned by find() and
+// try_emplace() are valid until the next insertion or erase.
+template<typename K, typename V, typename Hash = std::hash<K>>
+class FlatMap {
+private:
+	struct Entry {
+		K key;
+		V value;
+
+		template<typename... Args>
+		Entry(const K& key_, Args&&... args) : key(key_), value(std::forward<Args>(args)...) {}
+	};
+
+	constexpr static size_t MIN_CAPACITY = 16;
+
+	std::vector<std::optional<Entry>> slots;
+	size_t count = 0;
+	Hash hash;
+
+	size_t mask() const {
+		return slots.size() - 1;
+	}
+
+	size_t home(const K& key) const {
+		return hash(key) & mask();
+	}
+
+	// the slot of `key` or the empty slot ending its probe sequence
+	size_t probe(const K& key) const {
+		size_t i = home(key);
+		while (slots[i] && !(slots[i]->key == key)) {
+			i = (i + 1) & mask();
+		}
+		return i;
+	}
+
+	void grow() {
+		std::vector<std::optional<Entry>> old(std::max(MIN_CAPACITY, slots.size() * 2));
+		old.swap(slots);
+		for (auto& slot : old) {
+			if (slot) {
+				slots[probe(slot->key)].emplace(std::move(*slot));
+			}
+		}
+	}
+
+public:
+	FlatMap() : slots(MIN_CAPACITY) {}
+
+	size_t size() const {
+		return count;
+	}
+
+	bool empty() const {
+		return count == 0;
+	}
+
+	V* find(const K& key) {
+		auto& slot = slots[probe(key)];
+		return slot ? &slot->value : nullptr;
+	}
+
+	const V* find(const K& key) const {
+		auto& slot = slots[probe(key)];
+		return slot ? &slot->value : nullptr;
+	}
+
+	// constructs the value of `args` if `key` is missing;
+	// returns the value and whether it is new
+	template<typename... Args>
+	std::pair<V*, bool> try_emplace(const K& key, Args&&... args) {
+		if ((count + 1) * 2 > slots.size()) {
+			grow();
+		}
+
+		auto& slot = slots[probe(key)];
+		if (slot) {
+			return {&slot->value, false};
+		}
+		slot.emplace(key, std::forward<Args>(args)...);
+		++count;
+		return {&slot->value, true};
+	}
+
+	bool erase(const K& key) {
+		size_t i = probe(key);
+		if (!slots[i]) {
+			return false;
+		}
+		slots[i].reset();
+		--count;
+
+		// move back entries which can not be found past the hole
+		for (size_t j = (i + 1) & mask(); slots[j]; j = (j + 1) & mask()) {
+			size_t h = home(slots[j]->key);
+			// h is cyclically in (i, j]: the entry is reachable without the hole
+			bool stays = i <= j ? (i < h && h <= j) : (i < h || h <= j);
+			if (!stays) {
+				slots[i].emplace(std::move(*slots[j]));
+				slots[j].reset();
+				i = j;
+			}
+		}
+		return true;
+	}
+};
@@ -0,0 +1,188 @@
+#include "logger.h"
+
+#include <cerrno>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+
+namespace logging {
+
+namespace {
+
+// Drains the rings of all threads to stdout. Started by the first log
+// call; at exit it writes what is left and stops.
+class Writer {
+private:
+	std::mutex mutex;
+	// rings of exited threads stay till they are drained
+	std::vector<std::shared_ptr<Ring>> rings;
+	std::atomic<bool> is_working{true};
+
+	// an idle writer waits here, see sleep()
+	std::mutex sleep_mutex;
+	std::condition_variable wakeup;
+	bool woken = false;
+
+	fmt::memory_buffer out;
+
+	// the last member: it runs run() and needs the others constructed
+	std::thread thread;
+
+	static std::string_view prefix(Level level) {
+		switch (level) {
+			case Level::DEBUG:
+				return "[DEBUG] ";
+			case Level::INFO:
+				return "[INFO] ";
+			case Level::WARNING:
+				return "[WARNING] ";
+			case Level::ERROR:
+				return "[ERROR] ";
+		}
+		return "";
+	}
+
+	// formats pending records into `out`; false if there were none
+	bool drain() {
+		std::lock_guard lock(mutex);
+		bool drained = false;
+		for (auto it = rings.begin(); it != rings.end(); ) {
+			auto& ring = **it;
+			if (auto dropped = ring.take_dropped()) {
+				fmt::format_to(std::back_inserter(out), "[WARNING] log is full, {} messages dropped\n", dropped);
+			}
+			while (auto* record = ring.front()) {
+				auto p = prefix(record->level);
+				out.append(p.data(), p.data() + p.size());
+				record->render(*record, out);
+				if (record->suppressed) {
+					fmt::format_to(std::back_inserter(out), " ({} similar messages suppressed)", record->suppressed);
+				}
+				out.push_back('\n');
+				ring.pop();
+				drained = true;
+			}
+			// the thread has exited and everything is written
+			if (it->use_count() == 1 && !ring.front()) {
+				it = rings.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+		return drained;
+	}
+
+	// true if some ring has a record or a drop to report
+	bool pending() {
+		std::lock_guard lock(mutex);
+		for (auto& ring : rings) {
+			if (ring->front() || ring->has_dropped()) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Waits till a log call or the destructor wakes it. Log calls look at
+	// `writer_sleeps` after publishing a record, the rings are looked at
+	// after setting it, so a record made meanwhile is not missed.
+	void sleep() {
+		std::unique_lock lock(sleep_mutex);
+		writer_sleeps.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (!pending() && is_working.load(std::memory_order_relaxed)) {
+			wakeup.wait(lock, [this]() { return woken; });
+		}
+		woken = false;
+		// a waking log call has cleared it already, the destructor has not
+		writer_sleeps.store(false, std::memory_order_relaxed);
+	}
+
+	void flush() {
+		const char* data = out.data();
+		size_t left = out.size();
+		while (left > 0) {
+			auto written = ::write(STDOUT_FILENO, data, left);
+			if (written < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				// nowhere to report it
+				break;
+			}
+			data += written;
+			left -= written;
+		}
+		out.clear();
+	}
+
+	void run() {
+		while (is_working.load(std::memory_order_relaxed)) {
+			if (drain()) {
+				flush();
+			}
+			else {
+				sleep();
+			}
+		}
+		drain();
+		flush();
+	}
+
+public:
+	Writer() : thread([this]() { run(); }) {}
+
+	~Writer() {
+		is_working = false;
+		wake();
+		thread.join();
+	}
+
+	Writer(const Writer&) = delete;
+	Writer& operator=(const Writer&) = delete;
+
+	void wake() {
+		std::lock_guard lock(sleep_mutex);
+		woken = true;
+		wakeup.notify_one();
+	}
+
+	std::shared_ptr<Ring> add_ring() {
+		auto ring = std::make_shared<Ring>();
+		std::lock_guard lock(mutex);
+		rings.push_back(ring);
+		return ring;
+	}
+};
+
+Writer& writer() {
+	static Writer instance;
+	return instance;
+}
+
+} // namespace
+
+
+std::atomic<bool> writer_sleeps{false};
+
+void wake_writer() {
+	writer().wake();
+}
+
+Ring& thread_ring() {
+	thread_local std::shared_ptr<Ring> ring = writer().add_ring();
+	return *ring;
+}
+
+long int now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+} // namespace logging
@@ -0,0 +1,248 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <fmt/format.h>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+
+// Asynchronous logging. A log call copies its arguments into a ring of
+// the calling thread and returns; a background thread formats records and
+// writes them to stdout. Records of a thread keep their order, records of
+// different threads may interleave differently than they were made.
+// When a ring is full records are dropped and counted, a log call never
+// blocks. An idle writer sleeps till a log call wakes it.
+//
+// LOG_DEBUG, LOG_INFO, LOG_WARNING, LOG_ERROR take a fmt format string and
+// its arguments. Levels below MSG_HANDLER_LOG_LEVEL are compiled out with
+// their arguments. LOG_*_LIMITED pass one record per RATE_LIMIT_MS from a
+// call site of a thread, for messages clients can cause on every datagram.
+//
+// Arguments are formatted later in another thread, so they are stored by
+// value; strings are copied, other arguments should be trivially copyable.
+
+// 0 - debug, 1 - info, 2 - warning, 3 - error
+#ifndef MSG_HANDLER_LOG_LEVEL
+#define MSG_HANDLER_LOG_LEVEL 1
+#endif
+
+namespace logging {
+
+enum class Level {
+	DEBUG,
+	INFO,
+	WARNING,
+	ERROR,
+};
+
+constexpr Level MIN_LEVEL = Level(MSG_HANDLER_LOG_LEVEL);
+
+constexpr bool enabled(Level level) {
+	return level >= MIN_LEVEL;
+}
+
+constexpr static long int RATE_LIMIT_MS = 1000;
+
+
+struct Record {
+	constexpr static size_t ARGS_SIZE = 112;
+
+	// formats the record into `out` and destroys its arguments
+	using Render = void (*)(Record& record, fmt::memory_buffer& out);
+
+	Render render;
+	// format string, a literal
+	fmt::string_view text;
+	Level level;
+	// records of the call site dropped by the rate limit before this one
+	uint32_t suppressed;
+	// std::tuple of the arguments
+	alignas(std::max_align_t) unsigned char args[ARGS_SIZE];
+};
+
+
+// Single producer single consumer ring of records.
+class Ring {
+public:
+	constexpr static size_t SLOTS = 1024;
+
+private:
+	std::array<Record, SLOTS> records;
+	// next record to write, changed by the producer only
+	alignas(64) std::atomic<size_t> head{0};
+	// next record to read, changed by the consumer only
+	alignas(64) std::atomic<size_t> tail{0};
+	alignas(64) std::atomic<size_t> dropped{0};
+
+public:
+	// producer: a free record or nullptr if the ring is full
+	Record* reserve() {
+		auto h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) == SLOTS) {
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return nullptr;
+		}
+		return &records[h % SLOTS];
+	}
+
+	// producer: publishes the reserved record
+	void commit() {
+		head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	// consumer: the oldest record or nullptr if the ring is empty
+	Record* front() {
+		auto t = tail.load(std::memory_order_relaxed);
+		if (t == head.load(std::memory_order_acquire)) {
+			return nullptr;
+		}
+		return &records[t % SLOTS];
+	}
+
+	// consumer: frees the record returned by front()
+	void pop() {
+		tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	// consumer: records dropped since the last call
+	size_t take_dropped() {
+		return dropped.exchange(0, std::memory_order_relaxed);
+	}
+
+	// consumer: true if take_dropped() has something to report
+	bool has_dropped() const {
+		return dropped.load(std::memory_order_relaxed) > 0;
+	}
+};
+
+// ring of the calling thread, registered with the writer thread on first use
+Ring& thread_ring();
+
+// set while the writer thread sleeps on empty rings
+extern std::atomic<bool> writer_sleeps;
+
+// wakes the sleeping writer thread
+void wake_writer();
+
+
+// strings may not outlive the call, they are copied
+template<typename T>
+struct Stored {
+	using type = std::decay_t<T>;
+};
+
+template<>
+struct Stored<const char*> {
+	using type = std::string;
+};
+
+template<>
+struct Stored<char*> {
+	using type = std::string;
+};
+
+template<>
+struct Stored<std::string_view> {
+	using type = std::string;
+};
+
+template<typename T>
+using stored_t = typename Stored<std::decay_t<T>>::type;
+
+
+template<typename Args>
+void render(Record& record, fmt::memory_buffer& out) {
+	auto* args = std::launder(reinterpret_cast<Args*>(record.args));
+	std::apply([&](const auto&... values) {
+		fmt::vformat_to(std::back_inserter(out), record.text, fmt::make_format_args(values...));
+	}, *args);
+	args->~Args();
+}
+
+template<typename... Args>
+void write(Level level, uint32_t suppressed, fmt::format_string<Args...> text, Args&&... args) {
+	using Stored = std::tuple<stored_t<Args>...>;
+	static_assert(sizeof(Stored) <= Record::ARGS_SIZE, "too many log arguments");
+	static_assert(alignof(Stored) <= alignof(std::max_align_t), "log argument is overaligned");
+
+	auto& ring = thread_ring();
+	auto* record = ring.reserve();
+	if (!record) {
+		return;
+	}
+	record->render = &render<Stored>;
+	record->text = text;
+	record->level = level;
+	record->suppressed = suppressed;
+	new (record->args) Stored(std::forward<Args>(args)...);
+	ring.commit();
+	// pairs with the fence of the writer going to sleep: either it sees the
+	// record or this thread sees it asleep. A busy writer is never signalled,
+	// a sleeping one by the first thread clearing the flag.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (writer_sleeps.load(std::memory_order_relaxed) && writer_sleeps.exchange(false, std::memory_order_relaxed)) {
+		wake_writer();
+	}
+}
+
+
+// monotonic clock, coarse
+long int now_ms();
+
+// Passes a record per `interval_ms`, counts the others.
+class RateLimit {
+private:
+	long int next_ms = 0;
+	uint32_t suppressed = 0;
+
+public:
+	// true if a record is to be written now, `skipped` is set to the
+	// number of records suppressed before it
+	bool pass(uint32_t& skipped, long int interval_ms = RATE_LIMIT_MS) {
+		auto now = now_ms();
+		if (now < next_ms) {
+			++suppressed;
+			return false;
+		}
+		next_ms = now + interval_ms;
+		skipped = std::exchange(suppressed, 0);
+		return true;
+	}
+};
+
+} // namespace logging
+
+
+#define LOG_AT(level, ...) \
+	do { \
+		if constexpr (logging::enabled(logging::Level::level)) { \
+			logging::write(logging::Level::level, 0, __VA_ARGS__); \
+		} \
+	} while (false)
+
+#define LOG_LIMITED_AT(level, ...) \
+	do { \
+		if constexpr (logging::enabled(logging::Level::level)) { \
+			static thread_local logging::RateLimit rate_limit_; \
+			uint32_t suppressed_ = 0; \
+			if (rate_limit_.pass(suppressed_)) { \
+				logging::write(logging::Level::level, suppressed_, __VA_ARGS__); \
+			} \
+		} \
+	} while (false)
+
+#define LOG_DEBUG(...) LOG_AT(DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(INFO, __VA_ARGS__)
+#define LOG_WARNING(...) LOG_AT(WARNING, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(ERROR, __VA_ARGS__)
+
+#define LOG_WARNING_LIMITED(...) LOG_LIMITED_AT(WARNING, __VA_ARGS__)
+#define LOG_ERROR_LIMITED(...) LOG_LIMITED_AT(ERROR, __VA_ARGS__)
@@ -1,10 +1,20 @@
-#include "poller.h"
 #include "protocol.h"
+#include "reactor.h"
 #include "udp_transport.h"
-#include "device_info.h"
+#include "dev_info_provider.h"
+#include "flat_map.h"
+#include "logger.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
 #include <fmt/format.h>
 #include <map>
+#include <memory>
+#include <sys/epoll.h>
+#include <thread>
+#include <utility>
+#include <vector>
 
 
 using namespace std::placeholders;
@@ -15,152 +25,289 @@ int ts_label(long int ts) {
 }
 
 
+// A connection has a single timer, its deadline: after a ping it is the
+// end of the pong wait, after the pong - the time of the next ping.
 class Connection {
 private:
 	static const int PING_WAIT_MS = 10000;
 	static const int PING_INTERVAL_MS = 10000;
 
-	const UdpTransport& transport;
+	UdpTransport& transport;
+	Reactor& reactor;
 	Client client;
+	Reactor::TimerId deadline_timer;
 
 	long int last_ping_ts = 0;
 	bool got_pong = true;
 
 public:
-	Connection(const UdpTransport& transport_, Client&& client_) : transport(transport_), client(client_) {}
+	Connection(UdpTransport& transport_, Reactor& reactor_, Client&& client_, Reactor::Task on_deadline) :
+		transport(transport_),
+		reactor(reactor_),
+		client(client_),
+		deadline_timer(reactor.schedule(PING_WAIT_MS, std::move(on_deadline)))
+	{}
+
+	~Connection() {
+		if (deadline_timer) {
+			reactor.cancel(deadline_timer);
+		}
+	}
+
+	// moved by the connection table, the timer goes along
+	Connection(Connection&& other) :
+		transport(other.transport),
+		reactor(other.reactor),
+		client(other.client),
+		deadline_timer(std::exchange(other.deadline_timer, 0)),
+		last_ping_ts(other.last_ping_ts),
+		got_pong(other.got_pong)
+	{}
+
+	Connection(const Connection&) = delete;
+	Connection& operator=(const Connection&) = delete;
+	Connection& operator=(Connection&&) = delete;
 
 	const Client& get_client() const {
 		return client;
 	}
 
-	bool check_state(long int ts) {
-		//fmt::print("__deb {} {} {} \n", got_pong, ts - last_ping_ts;
-		if (!got_pong && (ts - last_ping_ts) > PING_WAIT_MS) {
+	// false if the pong wait is over
+	bool on_deadline(long int ts) {
+		if (!got_pong) {
 			return false;
 		}
-		if (got_pong && (ts - last_ping_ts) > PING_INTERVAL_MS) {
-			send_ping(ts);
-		}
+		send_ping(ts);
 		return true;
 	}
 
 	void send_ping(long int ts) {
-		transport.send(protocol::serialize(pb::PING), client);
+		transport.send_static(protocol::frame(pb::PING), client);
 		last_ping_ts = ts;
 		got_pong = false;
-		fmt::print("[INFO] sent ping to {} [{}]\n", client.label, ts_label(ts));
+		reactor.reschedule(deadline_timer, PING_WAIT_MS);
+		LOG_DEBUG("sent ping to {} [{}]", client, ts_label(ts));
 	}
 
-	void on_pong() {
+	void on_pong(long int ts) {
 		if (got_pong) {
-			fmt::print("[WARNING] unexpected pong from {}\n", client.label);
+			LOG_WARNING_LIMITED("unexpected pong from {}", client);
+			return;
 		}
 		got_pong = true;
+		reactor.reschedule(deadline_timer, std::max(0L, last_ping_ts + PING_INTERVAL_MS - ts));
 	}
 };
 
 
 class MsgHandler {
 private:
+	Reactor& reactor;
 	UdpTransport transport;
+	// messages of a received batch
+	protocol::Parser parser;
+	DevInfoProvider dev_info;
+	// EPOLLOUT is watched while the transport waits for the socket
+	bool waits_writable = false;
 
 	using MessageHandlerType = std::function<void(const pb::Message&, Client&& client)>;
 	const std::map<pb::MessageType, MessageHandlerType> handlers;
 
-	std::map<std::string, Connection> connections;
+	FlatMap<Ipv4Key, Connection, AddressHash> connections;
 
 public:
-	MsgHandler() :
-		transport{std::bind(&MsgHandler::on_data_recieved, this, _1, _2)},
+	MsgHandler(Reactor& reactor_, bool reuse_port, long int dev_info_refresh_ms) :
+		reactor(reactor_),
+		transport{std::bind(&MsgHandler::on_data_recieved, this, _1, _2), reuse_port},
+		dev_info(reactor, dev_info_refresh_ms),
 		handlers{
 			{pb::CONNECT,      std::bind(&MsgHandler::on_connect,      this, _1, _2)},
 			{pb::DISCONNECT,   std::bind(&MsgHandler::on_disconnect,   this, _1, _2)},
 			{pb::PONG,         std::bind(&MsgHandler::on_pong,         this, _1, _2)},
 			{pb::GET_DEV_INFO, std::bind(&MsgHandler::on_get_dev_info, this, _1, _2)},
 		}
-	{}
+	{
+		transport.set_batch_end_handler(std::bind(&protocol::Parser::reset, &parser));
+		reactor.add(transport.get_fd(), EPOLLIN, std::bind(&MsgHandler::on_socket_event, this, _1));
+		// replies and pings of an iteration go out together
+		reactor.at_iteration_end(std::bind(&MsgHandler::flush, this));
+	}
+
+	void on_socket_event(uint32_t events) {
+		if (events & EPOLLIN) {
+			transport.on_data_ready();
+		}
+		if (events & EPOLLOUT) {
+			flush();
+		}
+	}
 
-	const Transport& get_transport() const {
-		return transport;
+	void flush() {
+		bool flushed = transport.flush();
+		if (flushed == !waits_writable) {
+			return;
+		}
+		waits_writable = !flushed;
+		reactor.modify(transport.get_fd(), waits_writable ? EPOLLIN | EPOLLOUT : EPOLLIN);
 	}
 
-	void on_timer(long int ts) {
-		for (auto it = connections.begin(); it != connections.end(); ) {
-			if (!it->second.check_state(ts)) {
-				fmt::print("[INFO] Connection from {} is expired [{}]\n", it->first, ts_label(ts));
-				it = connections.erase(it);
-			}
-			else {
-				++it;
-			}
+	void on_connection_deadline(Ipv4Key addr) {
+		auto* connection = connections.find(addr);
+		if (!connection) {
+			return;
+		}
+		auto ts = curr_timestamp_ms();
+		if (!connection->on_deadline(ts)) {
+			LOG_INFO("Connection from {} is expired [{}]", connection->get_client(), ts_label(ts));
+			connections.erase(addr);
 		}
 	}
 
 	void on_data_recieved(std::string_view data, Client&& client) {
-		//fmt::print("recvfrom got message: {} from client {}\n", data, client.label);
-		auto msg = protocol::parseFrom(data);
+		//LOG_DEBUG("recvfrom got message: {} from client {}", data, client);
+		auto* msg = parser.parse(data);
 		if (!msg) {
-			fmt::print("[ERROR] message parsing fail: {}\n", data);
+			LOG_ERROR_LIMITED("message parsing fail: {}", data);
 			return;
 		}
 		auto it = handlers.find(msg->type());
 		if (it == handlers.end()) {
-			fmt::print("[ERROR] unsupported message type: {}\n", static_cast<int>(msg->type()));
+			LOG_ERROR_LIMITED("unsupported message type: {}", static_cast<int>(msg->type()));
 			return;
 		}
-		it->second(msg.value(), std::move(client));
+		it->second(*msg, std::move(client));
 	}
 
 	void on_connect(const pb::Message& /*msg*/, Client&& client) {
-		auto it = connections.find(client.label);
-		if (it != connections.end()) {
-			fmt::print("[WARNING] repeated connect from {}\n", client.label);
+		auto addr = client.addr;
+		auto [connection, added] = connections.try_emplace(
+			addr, transport, reactor, std::move(client),
+			[this, addr]() { on_connection_deadline(addr); }
+		);
+		if (!added) {
+			LOG_WARNING_LIMITED("repeated connect from {}", client);
 			return;
 		}
-		auto new_it = connections.emplace(client.label, Connection(transport, std::move(client))).first;
 		auto curr_ts = curr_timestamp_ms();
-		fmt::print("[INFO] Added new connection from {} [{}]\n", client.label, ts_label(curr_ts));
-		new_it->second.send_ping(curr_ts);
+		LOG_INFO("Added new connection from {} [{}]", connection->get_client(), ts_label(curr_ts));
+		connection->send_ping(curr_ts);
 	}
 
 	void on_disconnect(const pb::Message& /*msg*/, Client&& client) {
-		auto it = connections.find(client.label);
-		if (it == connections.end()) {
-			fmt::print("[WARNING] disconnect error, no connect to {}\n", client.label);
+		if (!connections.erase(client.addr)) {
+			LOG_WARNING_LIMITED("disconnect error, no connect to {}", client);
 			return;
 		}
-		connections.erase(it);
-		fmt::print("[INFO] disconnected from {}\n", client.label);
+		LOG_INFO("disconnected from {}", client);
 	}
 
 	void on_pong(const pb::Message& /*msg*/, Client&& client) {
-		auto it = connections.find(client.label);
-		if (it == connections.end()) {
-			fmt::print("[WARNING] pong error, no connect to {}\n", client.label);
+		auto* connection = connections.find(client.addr);
+		if (!connection) {
+			LOG_WARNING_LIMITED("pong error, no connect to {}", client);
 			return;
 		}
-		it->second.on_pong();
-		fmt::print("[INFO] got pong from {}\n", client.label);
+		connection->on_pong(curr_timestamp_ms());
+		LOG_DEBUG("got pong from {}", client);
 	}
 
 	void on_get_dev_info(const pb::Message& /*msg*/, Client&& client) {
-		auto it = connections.find(client.label);
-		if (it == connections.end()) {
-			fmt::print("[WARNING] get_dev_info error, no connect to {}\n", client.label);
+		auto* connection = connections.find(client.addr);
+		if (!connection) {
+			LOG_WARNING_LIMITED("get_dev_info error, no connect to {}", client);
 			return;
 		}
 
-		auto dev_info = protocol::serialized_dev_info(device_info::device_name(), device_info::os_version(), device_info::serial_number(), device_info::description());
-		transport.send(dev_info, it->second.get_client());
+		transport.send_static(dev_info.reply(), connection->get_client());
 	}
 };
 
 
+// number in the environment variable `var`, `default_value` if it is not set
+long int env_number(const char* var, long int default_value) {
+	auto* ch_value = getenv(var);
+	if (!ch_value) {
+		return default_value;
+	}
+
+	std::string str_value(ch_value);
+	std::size_t pos = 0;
+	long int value = -1;
+	try {
+		value = std::stol(str_value, &pos);
+	}
+	catch (...) {}
+	if (pos == 0 || pos != str_value.size() || value < 0) {
+		throw std::runtime_error(fmt::format("'{}' is wrong {} value", ch_value, var));
+	}
+	return value;
+}
+
+// Worker threads, each with its own socket, event loop and connections.
+// The sockets share the port with SO_REUSEPORT, the kernel sends all
+// datagrams of a client to the same socket, so workers share nothing.
+size_t workers_count() {
+	auto workers = env_number("MSG_HANDLER_WORKERS", 1);
+	// 0 - a worker per core
+	if (workers == 0) {
+		workers = std::max(1u, std::thread::hardware_concurrency());
+	}
+	return workers;
+}
+
+
 int main(int argc, const char** argv) {
-	MsgHandler handler;
+	// signals are blocked before starting workers, they all come to the main reactor
+	Reactor reactor;
+	reactor.stop_on_signals();
 
-	Poller::poll_loop(handler.get_transport(), std::bind(&MsgHandler::on_timer, &handler, _1));
+	auto workers = workers_count();
+	bool reuse_port = workers > 1;
+	// 0 - on file changes only
+	auto dev_info_refresh_ms = env_number("MSG_HANDLER_DEV_INFO_REFRESH_MS", DevInfoProvider::DEFAULT_REFRESH_MS);
+	if (reuse_port) {
+		LOG_INFO("running {} workers", workers);
+	}
 
-	fmt::print("Exiting\n");
+	// the main thread is the first worker; an error of any worker stops
+	// all of them through the main reactor
+	std::atomic<bool> failed{false};
+	std::vector<std::unique_ptr<Reactor>> worker_reactors;
+	std::vector<std::thread> threads;
+	try {
+		for (size_t i = 1; i < workers; ++i) {
+			auto& worker_reactor = *worker_reactors.emplace_back(std::make_unique<Reactor>());
+			threads.emplace_back([&worker_reactor, &reactor, &failed, i, reuse_port, dev_info_refresh_ms]() {
+				try {
+					MsgHandler handler(worker_reactor, reuse_port, dev_info_refresh_ms);
+					worker_reactor.run();
+				}
+				catch (const std::exception& e) {
+					LOG_ERROR("worker {} fail: {}", i, e.what());
+					failed = true;
+					reactor.stop();
+				}
+			});
+		}
+
+		MsgHandler handler(reactor, reuse_port, dev_info_refresh_ms);
+		reactor.run();
+	}
+	catch (const std::exception& e) {
+		LOG_ERROR("worker 0 fail: {}", e.what());
+		failed = true;
+	}
+
+	for (auto& worker_reactor : worker_reactors) {
+		worker_reactor->stop();
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+
+	if (failed) {
+		return EXIT_FAILURE;
+	}
+	LOG_INFO("Exiting");
 	return 0;
 }
@@ -1,14 +1,34 @@
 #include "protocol.h"
 
+#include <array>
 #include <fmt/format.h>
+#include <mutex>
+#include <unordered_set>
 
 
 namespace protocol {
 
+Parser::Parser() :
+	arena_block(new char[ARENA_BLOCK_SIZE]),
+	arena(arena_block.get(), ARENA_BLOCK_SIZE)
+{}
+
+const pb::Message* Parser::parse(std::string_view data) {
+	auto* msg = google::protobuf::Arena::CreateMessage<pb::Message>(&arena);
+	if (!msg->ParseFromArray(data.data(), data.size())) {
+		return nullptr;
+	}
+	return msg;
+}
+
+void Parser::reset() {
+	arena.Reset();
+}
+
 std::optional<pb::Message> parseFrom(std::string_view data) {
 	pb::Message ret;
 
-	if (!ret.ParseFromString(std::string(data))) {
+	if (!ret.ParseFromArray(data.data(), data.size())) {
 		return {};
 	}
 
@@ -31,6 +51,18 @@ std::string serialize(pb::MessageType type) {
 	return serialize(msg);
 }
 
+std::string_view frame(pb::MessageType type) {
+	static const auto frames = []() {
+		std::array<std::string, pb::MessageType_ARRAYSIZE> ret;
+		for (int type = pb::MessageType_MIN; type <= pb::MessageType_MAX; ++type) {
+			ret[type] = serialize(static_cast<pb::MessageType>(type));
+		}
+		return ret;
+	}();
+
+	return frames.at(type);
+}
+
 std::string serialized_dev_info(std::string_view device_name, std::string_view os_version, std::string_view serial_number, std::string_view description) {
 	pb::Message msg;
 	msg.set_type(pb::DEV_INFO);
@@ -46,4 +78,30 @@ std::string serialized_dev_info(std::string_view device_name, std::string_view o
 	return serialize(msg);
 }
 
+std::string_view dev_info_frame(std::string_view device_name, std::string_view os_version, std::string_view serial_number, std::string_view description) {
+	struct Last {
+		std::string device_name;
+		std::string os_version;
+		std::string serial_number;
+		std::string description;
+		std::string_view frame;
+	};
+
+	// shared by workers
+	static std::mutex mtx;
+	static Last last;
+	// node based, frames do not move
+	static std::unordered_set<std::string> frames;
+
+	std::lock_guard guard(mtx);
+	if (!last.frame.empty() && last.device_name == device_name && last.os_version == os_version &&
+		last.serial_number == serial_number && last.description == description) {
+		return last.frame;
+	}
+
+	std::string_view frame = *frames.insert(serialized_dev_info(device_name, os_version, serial_number, description)).first;
+	last = Last{std::string(device_name), std::string(os_version), std::string(serial_number), std::string(description), frame};
+	return frame;
+}
+
 } // namespace protocol
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <memory>
 #include <string>
 #include <optional>
 
@@ -7,9 +8,37 @@
 
 
 namespace protocol {
+	// Parses messages into its arena straight from the receive buffer.
+	// While a batch fits into the preallocated block, parsing allocates
+	// nothing. Parsed messages live until reset(), which is called when a
+	// batch of them is handled.
+	class Parser {
+	private:
+		const static size_t ARENA_BLOCK_SIZE = 64 * 1024;
+
+		std::unique_ptr<char[]> arena_block;
+		google::protobuf::Arena arena;
+
+	public:
+		Parser();
+		Parser(const Parser&) = delete;
+		Parser& operator=(const Parser&) = delete;
+
+		// nullptr if `data` is not a message
+		const pb::Message* parse(std::string_view data);
+		// frees all parsed messages, keeps the block
+		void reset();
+	};
+
 	std::optional<pb::Message> parseFrom(std::string_view data);
 	std::string serialize(const pb::Message& msg);
 	std::string serialize(pb::MessageType type);
+	// serialize(type) made once, in static storage
+	std::string_view frame(pb::MessageType type);
 
 	std::string serialized_dev_info(std::string_view device_name, std::string_view os_version, std::string_view serial_number, std::string_view description);
+	// serialized_dev_info() in static storage, made again only when the data
+	// differs from the previous call; frames are kept for the whole run, as
+	// they may be referenced by send queues
+	std::string_view dev_info_frame(std::string_view device_name, std::string_view os_version, std::string_view serial_number, std::string_view description);
 }
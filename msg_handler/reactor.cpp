@@ -0,0 +1,209 @@
+#include "reactor.h"
+
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <fmt/format.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+
+long int curr_timestamp_ms() {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+
+Reactor::Reactor() : timers(now_ms()) {
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		throw std::runtime_error(fmt::format("epoll_create1 fail: {}", strerror(errno)));
+	}
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		throw std::runtime_error(fmt::format("timerfd_create fail: {}", strerror(errno)));
+	}
+	wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeup_fd < 0) {
+		throw std::runtime_error(fmt::format("eventfd fail: {}", strerror(errno)));
+	}
+
+	add(timer_fd, EPOLLIN, [this](uint32_t) { on_timer_fd(); });
+	add(wakeup_fd, EPOLLIN, [this](uint32_t) { on_wakeup_fd(); });
+}
+
+Reactor::~Reactor() {
+	for (int fd : {signal_fd, wakeup_fd, timer_fd, epoll_fd}) {
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+}
+
+long int Reactor::now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void Reactor::add(int fd, uint32_t events, Handler handler) {
+	struct epoll_event ev{.events = events | EPOLLET, .data = {.fd = fd}};
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		throw std::runtime_error(fmt::format("epoll_ctl add fail: {}", strerror(errno)));
+	}
+	handlers[fd] = std::make_shared<Handler>(std::move(handler));
+}
+
+void Reactor::modify(int fd, uint32_t events) {
+	struct epoll_event ev{.events = events | EPOLLET, .data = {.fd = fd}};
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+		throw std::runtime_error(fmt::format("epoll_ctl mod fail: {}", strerror(errno)));
+	}
+}
+
+void Reactor::remove(int fd) {
+	if (handlers.erase(fd) > 0) {
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+	}
+}
+
+Reactor::TimerId Reactor::schedule(long int delay_ms, Task task) {
+	auto deadline_ms = now_ms() + delay_ms;
+	auto id = timers.schedule(deadline_ms, std::move(task));
+	arm_timer(deadline_ms);
+	return id;
+}
+
+Reactor::TimerId Reactor::schedule_every(long int period_ms, Task task) {
+	auto now = now_ms();
+	auto id = timers.schedule_every(now, period_ms, std::move(task));
+	arm_timer(now + period_ms);
+	return id;
+}
+
+void Reactor::reschedule(TimerId id, long int delay_ms) {
+	auto deadline_ms = now_ms() + delay_ms;
+	if (timers.reschedule(id, deadline_ms)) {
+		arm_timer(deadline_ms);
+	}
+}
+
+void Reactor::cancel(TimerId id) {
+	// the timerfd stays set, its wakeup just finds nothing due
+	timers.cancel(id);
+}
+
+void Reactor::arm_timer(long int deadline_ms) {
+	// the wheel fires timers on whole ticks
+	deadline_ms = (deadline_ms + TimerWheel::TICK_MS - 1) / TimerWheel::TICK_MS * TimerWheel::TICK_MS;
+	if (armed_ms != 0 && armed_ms <= deadline_ms) {
+		return;
+	}
+	armed_ms = deadline_ms;
+
+	struct itimerspec spec{};
+	spec.it_value.tv_sec = deadline_ms / 1000;
+	spec.it_value.tv_nsec = deadline_ms % 1000 * 1000000;
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr) < 0) {
+		throw std::runtime_error(fmt::format("timerfd_settime fail: {}", strerror(errno)));
+	}
+}
+
+void Reactor::on_timer_fd() {
+	uint64_t expirations;
+	while (read(timer_fd, &expirations, sizeof(expirations)) > 0) {}
+
+	armed_ms = 0;
+	timers.advance(now_ms());
+	// handlers could set it already
+	if (auto deadline_ms = timers.next_deadline_ms()) {
+		arm_timer(*deadline_ms);
+	}
+}
+
+void Reactor::at_iteration_end(Task task) {
+	iteration_end_tasks.push_back(std::move(task));
+}
+
+void Reactor::post(Task task) {
+	{
+		std::lock_guard guard(posted_mtx);
+		posted.push_back(std::move(task));
+	}
+	uint64_t one = 1;
+	[[maybe_unused]] auto res = write(wakeup_fd, &one, sizeof(one));
+}
+
+void Reactor::on_wakeup_fd() {
+	uint64_t count;
+	while (read(wakeup_fd, &count, sizeof(count)) > 0) {}
+
+	std::vector<Task> tasks;
+	{
+		std::lock_guard guard(posted_mtx);
+		tasks.swap(posted);
+	}
+	for (auto& task : tasks) {
+		task();
+	}
+}
+
+void Reactor::stop() {
+	is_working = false;
+	uint64_t one = 1;
+	[[maybe_unused]] auto res = write(wakeup_fd, &one, sizeof(one));
+}
+
+void Reactor::stop_on_signals() {
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	if (pthread_sigmask(SIG_BLOCK, &mask, nullptr) != 0) {
+		throw std::runtime_error("pthread_sigmask fail");
+	}
+
+	signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd < 0) {
+		throw std::runtime_error(fmt::format("signalfd fail: {}", strerror(errno)));
+	}
+	add(signal_fd, EPOLLIN, [this](uint32_t) { on_signal_fd(); });
+}
+
+void Reactor::on_signal_fd() {
+	struct signalfd_siginfo info;
+	while (read(signal_fd, &info, sizeof(info)) > 0) {
+		//fmt::print("Got signal {}\n", info.ssi_signo);
+		is_working = false;
+	}
+}
+
+void Reactor::run() {
+	struct epoll_event events[MAX_EVENTS];
+	while (is_working) {
+		int res = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw std::runtime_error(fmt::format("epoll_wait fail: {}", strerror(errno)));
+		}
+
+		for (int i = 0; i < res; ++i) {
+			auto it = handlers.find(events[i].data.fd);
+			if (it == handlers.end()) {
+				// removed by a handler called before
+				continue;
+			}
+			auto handler = it->second;
+			(*handler)(events[i].events);
+		}
+
+		for (auto& task : iteration_end_tasks) {
+			task();
+		}
+	}
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "timer_wheel.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+
+// wall clock, for messages
+long int curr_timestamp_ms();
+
+
+// Event loop on epoll.
+// Descriptors are watched edge-triggered: a handler has to read (write) until
+// EAGAIN, the next event comes on new data only.
+// Timers are kept in a TimerWheel, a timerfd wakes the loop at the closest
+// deadline, so there is no polling tick. An eventfd wakes the loop for tasks
+// posted from other threads and for stop().
+// Everything except post() and stop() is called from the loop thread only
+// (or before run()).
+class Reactor {
+public:
+	using Handler = std::function<void(uint32_t /*events*/)>;
+	using Task = std::function<void()>;
+	using TimerId = TimerWheel::TimerId;
+
+private:
+	const static int MAX_EVENTS = 64;
+
+	int epoll_fd = -1;
+	int timer_fd = -1;
+	int wakeup_fd = -1;
+	int signal_fd = -1;
+
+	// shared_ptr: a handler may remove its own descriptor
+	std::unordered_map<int, std::shared_ptr<Handler>> handlers;
+
+	TimerWheel timers;
+	// deadline the timerfd is set to, 0 - not set
+	long int armed_ms = 0;
+
+	std::mutex posted_mtx;
+	std::vector<Task> posted;
+
+	std::vector<Task> iteration_end_tasks;
+
+	// false after stop(), even if it was called before run()
+	std::atomic<bool> is_working{true};
+
+	void arm_timer(long int deadline_ms);
+	void on_timer_fd();
+	void on_wakeup_fd();
+	void on_signal_fd();
+
+public:
+	Reactor();
+	~Reactor();
+	Reactor(const Reactor&) = delete;
+	Reactor& operator=(const Reactor&) = delete;
+	Reactor(Reactor&&) = delete;
+	Reactor& operator=(Reactor&&) = delete;
+
+	// monotonic clock of timers
+	static long int now_ms();
+
+	// EPOLLET is always added to `events`
+	void add(int fd, uint32_t events, Handler handler);
+	void modify(int fd, uint32_t events);
+	void remove(int fd);
+
+	// `task` is called once in `delay_ms`
+	TimerId schedule(long int delay_ms, Task task);
+	// `task` is called every `period_ms`
+	TimerId schedule_every(long int period_ms, Task task);
+	// moves the next call of a timer to `delay_ms` from now
+	void reschedule(TimerId id, long int delay_ms);
+	void cancel(TimerId id);
+
+	// `task` is called after handlers of every batch of events, e.g. to flush
+	// data queued by them
+	void at_iteration_end(Task task);
+
+	// thread safe, `task` is called by the loop thread
+	void post(Task task);
+	// thread safe, run() returns after the current iteration
+	void stop();
+	// SIGINT and SIGTERM stop the loop; blocks these signals in the calling
+	// thread, so call it before starting other threads
+	void stop_on_signals();
+
+	void run();
+};
@@ -0,0 +1,200 @@
+#include "timer_wheel.h"
+
+#include <algorithm>
+
+
+TimerWheel::TimerWheel(long int now_ms) : next_tick(now_ms / TICK_MS + 1) {
+	slots[0].resize(LEVEL0_SLOTS, nullptr);
+	for (int level = 1; level < LEVELS; ++level) {
+		slots[level].resize(LEVEL_SLOTS, nullptr);
+	}
+}
+
+void TimerWheel::link(Timer& timer) {
+	// overdue - the next processed tick
+	long int tick = std::max(timer.deadline_tick, next_tick);
+	long int delta = tick - next_tick;
+	if (delta >= MAX_TICKS) {
+		// waits in the farthest slot, cascaded again from there
+		tick = next_tick + MAX_TICKS - 1;
+		delta = MAX_TICKS - 1;
+	}
+
+	int level = 0;
+	long int slot = tick & (LEVEL0_SLOTS - 1);
+	for (long int range = LEVEL0_SLOTS; delta >= range; range <<= LEVEL_BITS) {
+		++level;
+		slot = (tick >> (LEVEL0_BITS + LEVEL_BITS * (level - 1))) & (LEVEL_SLOTS - 1);
+	}
+
+	Timer*& head = slots[level][slot];
+	timer.next = head;
+	if (head) {
+		head->pprev = &timer.next;
+	}
+	head = &timer;
+	timer.pprev = &head;
+	timer.level = level;
+	++level_sizes[level];
+}
+
+void TimerWheel::unlink(Timer& timer) {
+	if (!timer.pprev) {
+		return;
+	}
+	*timer.pprev = timer.next;
+	if (timer.next) {
+		timer.next->pprev = timer.pprev;
+	}
+	timer.next = nullptr;
+	timer.pprev = nullptr;
+	--level_sizes[timer.level];
+}
+
+bool TimerWheel::upper_levels_empty() const {
+	for (int level = 1; level < LEVELS; ++level) {
+		if (level_sizes[level] != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void TimerWheel::cascade(int level, long int tick) {
+	long int slot = (tick >> (LEVEL0_BITS + LEVEL_BITS * (level - 1))) & (LEVEL_SLOTS - 1);
+	Timer* timer = slots[level][slot];
+	slots[level][slot] = nullptr;
+	while (timer) {
+		Timer* next = timer->next;
+		timer->pprev = nullptr;
+		--level_sizes[level];
+		link(*timer);
+		timer = next;
+	}
+}
+
+TimerWheel::TimerId TimerWheel::schedule(long int deadline_ms, Handler handler) {
+	auto id = ++last_id;
+	auto& timer = timers.emplace(id, Timer{id, to_tick(deadline_ms), 0, std::move(handler)}).first->second;
+	link(timer);
+	return id;
+}
+
+TimerWheel::TimerId TimerWheel::schedule_every(long int now_ms, long int period_ms, Handler handler) {
+	period_ms = std::max(period_ms, TICK_MS);
+	auto id = ++last_id;
+	auto& timer = timers.emplace(id, Timer{id, to_tick(now_ms + period_ms), period_ms, std::move(handler)}).first->second;
+	link(timer);
+	return id;
+}
+
+bool TimerWheel::reschedule(TimerId id, long int deadline_ms) {
+	auto it = timers.find(id);
+	if (it == timers.end()) {
+		return false;
+	}
+	unlink(it->second);
+	it->second.deadline_tick = to_tick(deadline_ms);
+	link(it->second);
+	return true;
+}
+
+bool TimerWheel::cancel(TimerId id) {
+	auto it = timers.find(id);
+	if (it == timers.end()) {
+		return false;
+	}
+	unlink(it->second);
+	timers.erase(it);
+	return true;
+}
+
+void TimerWheel::advance(long int now_ms) {
+	long int now_tick = now_ms / TICK_MS;
+
+	std::vector<TimerId> due;
+	for (; next_tick <= now_tick; ++next_tick) {
+		if (level_sizes[0] == 0) {
+			// nothing to fire before the next cascade, skip to it
+			long int boundary = (next_tick + LEVEL0_SLOTS - 1) & ~(LEVEL0_SLOTS - 1);
+			next_tick = upper_levels_empty() ? now_tick + 1 : std::min(boundary, now_tick + 1);
+			if (next_tick > now_tick) {
+				break;
+			}
+		}
+
+		// a lower level completes its turn: bring the next slot above down
+		for (int level = 1; level < LEVELS; ++level) {
+			long int shift = LEVEL0_BITS + LEVEL_BITS * (level - 1);
+			if ((next_tick & ((1L << shift) - 1)) != 0) {
+				break;
+			}
+			cascade(level, next_tick);
+		}
+
+		long int slot = next_tick & (LEVEL0_SLOTS - 1);
+		Timer* timer = slots[0][slot];
+		slots[0][slot] = nullptr;
+		while (timer) {
+			Timer* next = timer->next;
+			timer->pprev = nullptr;
+			--level_sizes[0];
+			if (timer->deadline_tick > next_tick) {
+				// was too far for the wheel
+				link(*timer);
+			}
+			else {
+				due.push_back(timer->id);
+			}
+			timer = next;
+		}
+	}
+
+	for (auto id : due) {
+		auto it = timers.find(id);
+		if (it == timers.end() || it->second.pprev) {
+			// cancelled or rescheduled by a handler called before
+			continue;
+		}
+
+		// the handler may cancel or reschedule its own timer
+		auto handler = std::move(it->second.handler);
+		handler();
+
+		it = timers.find(id);
+		if (it == timers.end()) {
+			continue;
+		}
+		auto& timer = it->second;
+		timer.handler = std::move(handler);
+		if (timer.pprev) {
+			continue;
+		}
+		if (timer.period_ms == 0) {
+			timers.erase(it);
+		}
+		else {
+			timer.deadline_tick += timer.period_ms / TICK_MS;
+			link(timer);
+		}
+	}
+}
+
+std::optional<long int> TimerWheel::next_deadline_ms() const {
+	if (timers.empty()) {
+		return std::nullopt;
+	}
+
+	bool upper_levels = !upper_levels_empty();
+	for (long int tick = next_tick; tick < next_tick + LEVEL0_SLOTS; ++tick) {
+		if (upper_levels && (tick & (LEVEL0_SLOTS - 1)) == 0) {
+			// cascade
+			return tick * TICK_MS;
+		}
+		if (slots[0][tick & (LEVEL0_SLOTS - 1)]) {
+			return tick * TICK_MS;
+		}
+	}
+	// a timer is being fired
+	return next_tick * TICK_MS;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+
+// Hierarchical timing wheel. Level 0 has a slot per tick for the next
+// LEVEL0_SLOTS ticks. Each next level has LEVEL_SLOTS slots, and each of
+// its slots covers a whole turn of the level below. When a lower level
+// completes a turn, the next slot of the level above is cascaded: its timers
+// go down to finer slots. Timers further than all levels wait in the last
+// slot and are cascaded again.
+// Timers are in intrusive lists, so schedule, reschedule and cancel are
+// O(1), and advance() costs a step per elapsed tick plus a step per fired
+// or cascaded timer, whatever the number of timers.
+// Time is in ms of any monotonic clock, resolution is TICK_MS.
+// Not thread safe.
+class TimerWheel {
+public:
+	using TimerId = uint64_t;
+	using Handler = std::function<void()>;
+
+	constexpr static long int TICK_MS = 10;
+	// 256 ticks * 64^3: about 7.7 days at 10 ms
+	constexpr static int LEVEL0_BITS = 8;
+	constexpr static int LEVEL_BITS = 6;
+	constexpr static int LEVELS = 4;
+
+private:
+	constexpr static long int LEVEL0_SLOTS = 1 << LEVEL0_BITS;
+	constexpr static long int LEVEL_SLOTS = 1 << LEVEL_BITS;
+	constexpr static long int MAX_TICKS = LEVEL0_SLOTS << (LEVEL_BITS * (LEVELS - 1));
+
+	struct Timer {
+		TimerId id;
+		long int deadline_tick;
+		// 0 - one shot
+		long int period_ms;
+		Handler handler;
+
+		// slot list, pprev points to the pointer pointing to this timer;
+		// nullptr - not in a slot (being fired)
+		Timer* next = nullptr;
+		Timer** pprev = nullptr;
+		int level = 0;
+	};
+
+	// map nodes do not move, slots keep pointers to them
+	std::unordered_map<TimerId, Timer> timers;
+	std::vector<Timer*> slots[LEVELS];
+	size_t level_sizes[LEVELS] = {};
+
+	TimerId last_id = 0;
+	// ticks before this one are processed
+	long int next_tick;
+
+	static long int to_tick(long int ms) {
+		// rounded up, a timer never fires early
+		return (ms + TICK_MS - 1) / TICK_MS;
+	}
+
+	void link(Timer& timer);
+	void unlink(Timer& timer);
+	bool upper_levels_empty() const;
+	void cascade(int level, long int tick);
+
+public:
+	TimerWheel(long int now_ms);
+
+	// handler is called once at `deadline_ms` or later
+	TimerId schedule(long int deadline_ms, Handler handler);
+	// handler is called every `period_ms` starting from now + period_ms
+	TimerId schedule_every(long int now_ms, long int period_ms, Handler handler);
+	// moves the next call of a timer to `deadline_ms`, a one shot timer may
+	// be rescheduled by its own handler; false if the timer is unknown
+	bool reschedule(TimerId id, long int deadline_ms);
+	// false if the timer has fired (one shot) or is unknown
+	bool cancel(TimerId id);
+
+	// calls handlers of timers due by `now_ms`, handlers may schedule and cancel timers
+	void advance(long int now_ms);
+
+	// time to call advance() at, earlier than the closest deadline if
+	// timers are to be cascaded before it; nullopt if there are no timers
+	std::optional<long int> next_deadline_ms() const;
+
+	bool empty() const {
+		return timers.empty();
+	}
+
+	size_t size() const {
+		return timers.size();
+	}
+};
@@ -1,19 +1,30 @@
 #pragma once
 
-#include <any>
+#include "address.h"
+
+#include <fmt/format.h>
 #include <functional>
 #include <string>
 
 
 struct Client {
-	std::string label;
-	std::any addr;
+	Ipv4Key addr;
+};
+
+// "address:port", made when a client is printed only
+template<>
+struct fmt::formatter<Client> : fmt::formatter<std::string> {
+	template<typename FormatContext>
+	auto format(const Client& client, FormatContext& ctx) const {
+		return fmt::formatter<std::string>::format(::to_string(client.addr), ctx);
+	}
 };
 
 
 class Transport {
 public:
 	using DataHandlerType = std::function<void(std::string_view, Client&&)>;
+	using BatchEndHandlerType = std::function<void()>;
 	Transport(DataHandlerType data_handler) : on_data_received(std::move(data_handler)) {}
 
 	virtual ~Transport() = default;
@@ -23,9 +34,24 @@ public:
     Transport& operator=(const Transport&&) = delete;
 
 	virtual int get_fd() const = 0;
-	virtual void on_data_ready() const = 0;
-	virtual bool send(std::string_view data, const Client& client) const = 0;
+	// called after the data handler got a batch of datagrams, data passed
+	// to it is not used anymore
+	void set_batch_end_handler(BatchEndHandlerType batch_end_handler) {
+		on_batch_end = std::move(batch_end_handler);
+	}
+
+	// reads everything available, calls the data handler for every datagram
+	virtual void on_data_ready() = 0;
+	// queues a datagram, false if it is dropped (the queue is full)
+	virtual bool send(std::string_view data, const Client& client) = 0;
+	// the same without copying `data`: it has to stay valid until sent,
+	// e.g. a frame of protocol::frame()
+	virtual bool send_static(std::string_view data, const Client& client) = 0;
+	// sends queued datagrams, false if some of them wait for the socket
+	// to become writable (EPOLLOUT)
+	virtual bool flush() = 0;
 
 protected:
 	DataHandlerType on_data_received;
+	BatchEndHandlerType on_batch_end;
 };
@@ -1,8 +1,10 @@
 #include "udp_transport.h"
+#include "logger.h"
 
-#include <cassert>
+#include <algorithm>
 #include <cerrno>
 #include <fmt/format.h>
+#include <mutex>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -13,8 +15,10 @@ int listened_port() {
 	const int DEFAULT_PORT = 10123;
 	const char* PORT_ENV_VAR = "MSG_HANDLER_UDP_PORT";
 
+	// workers may open their sockets concurrently
 	static int port = -1;
-	if (port < 0) {
+	static std::once_flag once;
+	std::call_once(once, [&]() {
 		auto* ch_port = getenv(PORT_ENV_VAR);
 		if (ch_port) {
 			std::string str_port(ch_port);
@@ -30,19 +34,35 @@ int listened_port() {
 		else {
 			port = DEFAULT_PORT;
 		}
-		fmt::print("[INFO] listened UDP port {}\n", port);
-	}
+		LOG_INFO("listened UDP port {}", port);
+	});
 
 	return port;
 }
 
 
-UdpTransport::UdpTransport(Transport::DataHandlerType data_handler) : Transport(std::move(data_handler)) {
+UdpTransport::UdpTransport(Transport::DataHandlerType data_handler, bool reuse_port, size_t recv_batch_) :
+	Transport(std::move(data_handler)),
+	recv_batch(std::max<size_t>(recv_batch_, 1)),
+	recv_bufs(recv_batch * BUF_SIZE),
+	recv_iovs(recv_batch),
+	recv_addrs(recv_batch),
+	recv_msgs(recv_batch)
+{
+	for (size_t i = 0; i < recv_batch; ++i) {
+		recv_iovs[i] = {.iov_base = &recv_bufs[i * BUF_SIZE], .iov_len = BUF_SIZE};
+	}
+
 	sock = socket(AF_INET, SOCK_DGRAM, 0);
 	if (sock < 0) {
 		throw std::runtime_error(fmt::format("socket fail: {}", strerror(errno)));
 	}
 
+	int one = 1;
+	if (reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+		throw std::runtime_error(fmt::format("setsockopt SO_REUSEPORT fail: {}", strerror(errno)));
+	}
+
 	struct sockaddr_in serv_addr;
 	memset(&serv_addr, 0, sizeof(serv_addr));
 	serv_addr.sin_family = AF_INET;
@@ -64,41 +84,134 @@ int UdpTransport::get_fd() const {
 	return sock;
 }
 
-void UdpTransport::on_data_ready() const {
-	struct sockaddr_in client_addr;
-	memset(&client_addr, 0, sizeof(client_addr));
-	socklen_t addr_len = sizeof(client_addr);
+void UdpTransport::on_data_ready() {
+	// edge-triggered: read until the socket is empty
+	while (true) {
+		for (size_t i = 0; i < recv_batch; ++i) {
+			auto& hdr = recv_msgs[i].msg_hdr;
+			memset(&hdr, 0, sizeof(hdr));
+			hdr.msg_name = &recv_addrs[i];
+			hdr.msg_namelen = sizeof(struct sockaddr_in);
+			hdr.msg_iov = &recv_iovs[i];
+			hdr.msg_iovlen = 1;
+		}
 
-	char buf[BUF_SIZE];
-	int recv_n = recvfrom(sock, buf, BUF_SIZE, MSG_DONTWAIT, reinterpret_cast<struct sockaddr*>(&client_addr), &addr_len);
+		int recv_n = recvmmsg(sock, recv_msgs.data(), recv_batch, MSG_DONTWAIT, nullptr);
+		if (recv_n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				LOG_ERROR_LIMITED("recvmmsg fail: {} ({})", strerror(errno), errno);
+			}
+			return;
+		}
 
-	if (recv_n < 0) {
-		fmt::print("[ERROR] recvfrom fail: {} ({})\n", strerror(errno), errno);
-	}
-	else if (recv_n >= static_cast<int>(BUF_SIZE)) {
-		fmt::print("[ERROR] recvfrom got too long message (length={}), dropping it\n", recv_n);
-	}
-	else {
-		std::string_view data(buf, recv_n);
-		char addr_buf[128];
-		on_data_received(
-			data,
-			Client{
-				.label = fmt::format("{}:{}", inet_ntop(client_addr.sin_family, &client_addr.sin_addr, addr_buf, sizeof(addr_buf)), ntohs(client_addr.sin_port)),
-				.addr = client_addr
+		for (int i = 0; i < recv_n; ++i) {
+			auto& msg = recv_msgs[i];
+			if (msg.msg_hdr.msg_flags & MSG_TRUNC) {
+				LOG_ERROR_LIMITED("recvmmsg got too long message (length>={}), dropping it", msg.msg_len);
+				continue;
 			}
-		);
+
+			std::string_view data(&recv_bufs[i * BUF_SIZE], msg.msg_len);
+			on_data_received(data, Client{.addr = pack(recv_addrs[i])});
+		}
+
+		if (on_batch_end) {
+			on_batch_end();
+		}
+
+		// a short batch empties the socket, new data brings a new event
+		if (recv_n < static_cast<int>(recv_batch)) {
+			return;
+		}
 	}
 }
 
-bool UdpTransport::send(std::string_view data, const Client& client) const {
-	auto& addr = std::any_cast<const struct sockaddr_in&>(client.addr);
-	int snt_n = sendto(sock, data.data(), data.size(), 0, reinterpret_cast<const struct sockaddr*>(&addr), sizeof(struct sockaddr_in));
-	if (snt_n < 0) {
-		fmt::print("[ERROR] sendto fail: {} ({})\n", strerror(errno), errno);
+bool UdpTransport::send(std::string_view data, const Client& client) {
+	return enqueue(nullptr, data, client);
+}
+
+bool UdpTransport::send_static(std::string_view data, const Client& client) {
+	return enqueue(data.data(), data, client);
+}
+
+bool UdpTransport::enqueue(const char* data, std::string_view copied, const Client& client) {
+	if (send_queue.size() - send_head >= SEND_QUEUE_LIMIT) {
+		LOG_ERROR_LIMITED("send queue is full, dropping message to {}", client);
 		return false;
 	}
-	//fmt::print("sent {}\n", snt_n);
-	assert(snt_n == static_cast<int>(data.size()));
+
+	send_queue.push_back(Pending{.data = data, .offset = send_buf.size(), .size = copied.size(), .addr = unpack(client.addr)});
+	if (!data) {
+		send_buf.append(copied);
+	}
+
+	if (!send_blocked && send_queue.size() - send_head >= SEND_BATCH) {
+		flush();
+	}
 	return true;
 }
+
+bool UdpTransport::flush() {
+	struct iovec iovs[SEND_BATCH];
+	struct mmsghdr msgs[SEND_BATCH];
+
+	while (send_head < send_queue.size()) {
+		size_t batch = std::min(SEND_BATCH, send_queue.size() - send_head);
+		for (size_t i = 0; i < batch; ++i) {
+			auto& pending = send_queue[send_head + i];
+			auto* data = pending.data ? pending.data : &send_buf[pending.offset];
+			iovs[i] = {.iov_base = const_cast<char*>(data), .iov_len = pending.size};
+			memset(&msgs[i], 0, sizeof(msgs[i]));
+			msgs[i].msg_hdr.msg_name = &pending.addr;
+			msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		int snt_n = sendmmsg(sock, msgs, batch, MSG_DONTWAIT);
+		if (snt_n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+				// the rest goes on EPOLLOUT
+				send_blocked = true;
+				drop_sent();
+				return false;
+			}
+			// the first datagram fails alone, others may go
+			LOG_ERROR_LIMITED("sendmmsg fail: {} ({})", strerror(errno), errno);
+			snt_n = 1;
+		}
+		send_head += snt_n;
+	}
+
+	send_buf.clear();
+	send_queue.clear();
+	send_head = 0;
+	send_blocked = false;
+	return true;
+}
+
+void UdpTransport::drop_sent() {
+	if (send_head == 0) {
+		return;
+	}
+	size_t sent_bytes = 0;
+	for (size_t i = 0; i < send_head; ++i) {
+		if (!send_queue[i].data) {
+			sent_bytes += send_queue[i].size;
+		}
+	}
+	send_buf.erase(0, sent_bytes);
+	send_queue.erase(send_queue.begin(), send_queue.begin() + send_head);
+	for (auto& pending : send_queue) {
+		if (!pending.data) {
+			pending.offset -= sent_bytes;
+		}
+	}
+	send_head = 0;
+}
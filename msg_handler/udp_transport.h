@@ -2,17 +2,62 @@
 
 #include "transport.h"
 
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <vector>
+
+
+// MSG_HANDLER_UDP_PORT or the default one
+int listened_port();
+
 
 class UdpTransport: public Transport {
 private:
 	const static size_t BUF_SIZE = 1000;
 	int sock = -1;
 
+	// receive ring, one recvmmsg fills up to `recv_batch` buffers
+	const size_t recv_batch;
+	std::vector<char> recv_bufs;
+	std::vector<struct iovec> recv_iovs;
+	std::vector<struct sockaddr_in> recv_addrs;
+	std::vector<struct mmsghdr> recv_msgs;
+
+	// send queue: copied datagrams one after another in `send_buf`,
+	// static ones are referenced
+	struct Pending {
+		// nullptr - at `offset` in `send_buf`
+		const char* data;
+		size_t offset;
+		size_t size;
+		struct sockaddr_in addr;
+	};
+	std::string send_buf;
+	std::vector<Pending> send_queue;
+	// sent datagrams at the queue head
+	size_t send_head = 0;
+	// the last flush stopped on a full socket buffer
+	bool send_blocked = false;
+
+	bool enqueue(const char* data, std::string_view copied, const Client& client);
+	// removes sent datagrams from the queue
+	void drop_sent();
+
 public:
-	UdpTransport(Transport::DataHandlerType data_handler);
+	constexpr static size_t RECV_BATCH = 64;
+	// datagrams per sendmmsg, a queue this long is sent without waiting for flush()
+	constexpr static size_t SEND_BATCH = 64;
+	// datagrams waiting for the socket at most, later ones are dropped
+	constexpr static size_t SEND_QUEUE_LIMIT = 16384;
+
+	// reuse_port: sockets of several workers share the port (SO_REUSEPORT),
+	// the kernel spreads clients among them by address hash
+	UdpTransport(Transport::DataHandlerType data_handler, bool reuse_port = false, size_t recv_batch = RECV_BATCH);
 	~UdpTransport();
 
 	int get_fd() const override;
-	void on_data_ready() const override;
-	bool send(std::string_view data, const Client& client) const override;
+	void on_data_ready() override;
+	bool send(std::string_view data, const Client& client) override;
+	bool send_static(std::string_view data, const Client& client) override;
+	bool flush() override;
 };